@@ -3,19 +3,25 @@
 
 #include "rtweekend.h"
 
-class aabb {
+template <typename T>
+class basic_aabb {
   public:
+    using interval = basic_interval<T>;
+    using point3 = basic_vec3<T>;
+    using vec3 = basic_vec3<T>;
+    using ray = basic_ray<T>;
+
     interval x, y, z;
 
-    aabb() {} // The default AABB is empty, since intervals are empty by default.
+    basic_aabb() {} // The default AABB is empty, since intervals are empty by default.
 
-    aabb(const interval& x, const interval& y, const interval& z)
+    basic_aabb(const interval& x, const interval& y, const interval& z)
       : x(x), y(y), z(z)
     {
         pad_to_minimums();
     }
 
-    aabb(const point3& a, const point3& b) {
+    basic_aabb(const point3& a, const point3& b) {
         // Treat the two points a and b as extrema for the bounding box, so we don't require a
         // particular minimum/maximum coordinate order.
         x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
@@ -24,7 +30,7 @@ class aabb {
         pad_to_minimums();
     }
 
-    aabb(const aabb& box0, const aabb& box1) {
+    basic_aabb(const basic_aabb& box0, const basic_aabb& box1) {
         x = interval(box0.x, box1.x);
         y = interval(box0.y, box1.y);
         z = interval(box0.z, box1.z);
@@ -42,7 +48,7 @@ class aabb {
 
         for (int axis = 0; axis < 3; axis++) {
             const interval& ax = axis_interval(axis);
-            const double adinv = 1.0 / ray_dir[axis];
+            const T adinv = 1 / ray_dir[axis];
 
             auto t0 = (ax.min - ray_orig[axis]) * adinv;
             auto t1 = (ax.max - ray_orig[axis]) * adinv;
@@ -55,7 +61,9 @@ class aabb {
                 if (t0 < ray_t.max) ray_t.max = t0;
             }
 
-            if (ray_t.max <= ray_t.min)
+            // A box padded to the minimum width can round to a single t far from the
+            // ray origin in single precision; it is still hit there.
+            if (ray_t.max < ray_t.min)
                 return false;
         }
         return true;
@@ -69,28 +77,36 @@ class aabb {
             return y.size() > z.size() ? 1 : 2;
     }
 
-    static const aabb empty, universe;
+    static const basic_aabb empty, universe;
 
     private:
 
     void pad_to_minimums() {
         // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
 
-        double delta = 0.0001;
+        T delta = 0.0001;
         if (x.size() < delta) x = x.expand(delta);
         if (y.size() < delta) y = y.expand(delta);
         if (z.size() < delta) z = z.expand(delta);
     }
 };
 
-inline const aabb aabb::empty    = aabb(interval::empty,    interval::empty,    interval::empty);
-inline const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+template <typename T>
+const basic_aabb<T> basic_aabb<T>::empty
+    = basic_aabb<T>(basic_interval<T>::empty, basic_interval<T>::empty, basic_interval<T>::empty);
+template <typename T>
+const basic_aabb<T> basic_aabb<T>::universe
+    = basic_aabb<T>(basic_interval<T>::universe, basic_interval<T>::universe, basic_interval<T>::universe);
+
+using aabb = basic_aabb<real>;
 
-aabb operator+(const aabb& bbox, const vec3& offset) {
-    return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
+template <typename T>
+basic_aabb<T> operator+(const basic_aabb<T>& bbox, const basic_vec3<T>& offset) {
+    return basic_aabb<T>(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
 }
 
-aabb operator+(const vec3& offset, const aabb& bbox) {
+template <typename T>
+basic_aabb<T> operator+(const basic_vec3<T>& offset, const basic_aabb<T>& bbox) {
     return bbox + offset;
 }
 
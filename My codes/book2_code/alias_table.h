@@ -0,0 +1,89 @@
+// This file defines alias_table, which picks an index with probability proportional to a
+// weight in constant time. The table splits the weights into equal bins of one index and
+// at most one alias each (Vose's method), so a pick is one bin lookup and one comparison.
+
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <vector>
+
+class alias_table {
+  public:
+    alias_table() {}
+
+    // Builds the table of weights, which must not be negative. If all weights are zero,
+    // every index is equally likely.
+    explicit alias_table(const std::vector<double>& weights) : bins(weights.size()) {
+        int n = int(weights.size());
+        if (n == 0) return;
+
+        double total = 0;
+        for (auto w : weights) total += w;
+
+        for (int i = 0; i < n; i++)
+            bins[i].pmf = total > 0 ? weights[i] / total : 1.0 / n;
+
+        // Bins below the mean are topped up by an alias from a bin above it, which then
+        // carries on with what remains of its weight.
+        std::vector<int> under, over;
+        std::vector<double> scaled(n);
+        for (int i = 0; i < n; i++) {
+            scaled[i] = bins[i].pmf * n;
+            (scaled[i] < 1 ? under : over).push_back(i);
+        }
+
+        while (!under.empty() && !over.empty()) {
+            int small = under.back(), large = over.back();
+            under.pop_back();
+            bins[small].keep = scaled[small];
+            bins[small].alias = large;
+
+            scaled[large] -= 1 - scaled[small];
+            if (scaled[large] < 1) {
+                over.pop_back();
+                under.push_back(large);
+            }
+        }
+
+        // Whatever is left is one bin's worth, up to rounding.
+        for (int i : under) bins[i].keep = 1;
+        for (int i : over) bins[i].keep = 1;
+    }
+
+    bool empty() const { return bins.empty(); }
+    int size() const { return int(bins.size()); }
+
+    // Picks an index by u in [0,1). The fraction of u left over after picking a bin decides
+    // between the bin and its alias, and is returned in remapped, uniform in [0,1) again.
+    int sample(double u, double* remapped = nullptr) const {
+        int n = int(bins.size());
+        auto scaled = u * n;
+        int i = std::min(int(scaled), n - 1);
+        auto fraction = std::min(scaled - i, 1 - 0x1p-53);
+
+        const auto& b = bins[i];
+        if (fraction < b.keep) {
+            if (remapped) *remapped = std::min(fraction / b.keep, 1 - 0x1p-53);
+            return i;
+        }
+        if (remapped) *remapped = std::min((fraction - b.keep) / (1 - b.keep), 1 - 0x1p-53);
+        return b.alias;
+    }
+
+    // The probability of picking index i.
+    double pmf(int i) const { return bins[i].pmf; }
+
+  private:
+    struct bin {
+        double keep = 1;  // Probability of keeping the bin's own index
+        int alias = 0;    // Index picked otherwise
+        double pmf = 0;   // Probability of picking the bin's own index overall
+    };
+
+    std::vector<bin> bins;
+};
+
+#endif
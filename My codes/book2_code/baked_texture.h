@@ -0,0 +1,166 @@
+// This file defines baked_texture, a texture sampled once into a grid when the scene is
+// built, so shading reads stored texels instead of evaluating the texture on every hit.
+// Procedural textures such as noise_texture, which run many octaves of noise per lookup,
+// can be baked either over a 3D grid of points or over a (u,v) atlas of one surface. The
+// grid resolution and its texel_format trade memory for accuracy.
+
+#ifndef BAKED_TEXTURE_H
+#define BAKED_TEXTURE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "mipmap.h"
+#include "texture.h"
+#include "texture_storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+class baked_texture : public texture {
+  public:
+    // Samples source at the centers of a 3D grid of cells over bounds, with resolution cells
+    // along its longest axis. Points outside bounds are still evaluated by source.
+    baked_texture(shared_ptr<texture> source, const aabb& bounds, int resolution,
+                  texel_format format = texel_format::srgb8)
+      : source(source), bounds(bounds)
+    {
+        auto longest = std::max({bounds.x.size(), bounds.y.size(), bounds.z.size()});
+        cell = real(longest / std::max(resolution, 1));
+        for (int a = 0; a < 3; a++)
+            cells[a] = std::max(1, int(std::ceil(bounds.axis_interval(a).size() / cell)));
+
+        // Slices along z are stacked vertically in one 2D storage.
+        std::vector<float> rgb(3 * size_t(cells[0]) * cells[1] * cells[2]);
+        sample_rows(cells[1] * cells[2], [&](int row) {
+            int y = row % cells[1], z = row / cells[1];
+            for (int x = 0; x < cells[0]; x++) {
+                auto p = point3(bounds.x.min + (x + 0.5) * cell, bounds.y.min + (y + 0.5) * cell,
+                                bounds.z.min + (z + 0.5) * cell);
+                store(&rgb[3 * (size_t(row) * cells[0] + x)], this->source->value(0, 0, p));
+            }
+        });
+        grid = texture_storage(rgb.data(), cells[0], cells[1] * cells[2], format);
+    }
+
+    // Samples source over a width x height atlas of (u,v), at the points surface(u,v) gives,
+    // e.g. the point of a sphere with those texture coordinates. Lookups read the atlas by
+    // (u,v) alone, filtered through its mipmap like an image_texture.
+    baked_texture(shared_ptr<texture> source, int width, int height,
+                  const std::function<point3(double, double)>& surface,
+                  texel_format format = texel_format::srgb8)
+      : source(source), atlas(true)
+    {
+        // Rows run down from v = 1, as in images.
+        std::vector<float> rgb(3 * size_t(width) * height);
+        sample_rows(height, [&](int y) {
+            auto v = 1 - (y + 0.5) / height;
+            for (int x = 0; x < width; x++) {
+                auto u = (x + 0.5) / width;
+                store(&rgb[3 * (size_t(y) * width + x)], this->source->value(u, v, surface(u, v)));
+            }
+        });
+        mips = mipmap(rgb.data(), width, height, format);
+    }
+
+    // Returns tex baked over bounds if RTW_BAKE_RESOLUTION sets a grid resolution, or tex
+    // itself. The grid is stored in image_texture::default_format().
+    static shared_ptr<texture> bake_if_enabled(shared_ptr<texture> tex, const aabb& bounds) {
+        auto resolution = std::getenv("RTW_BAKE_RESOLUTION");
+        if (!resolution || std::atoi(resolution) <= 0)
+            return tex;
+
+        auto baked = make_shared<baked_texture>(tex, bounds, std::atoi(resolution),
+                                                image_texture::default_format());
+        std::clog << "Baked texture: " << baked->cells[0] << 'x' << baked->cells[1] << 'x'
+                  << baked->cells[2] << ' ' << texel_format_name(baked->grid.format()) << ", "
+                  << baked->size_in_bytes() / 1024 << " KiB\n";
+        return baked;
+    }
+
+    size_t size_in_bytes() const { return atlas ? mips.size_in_bytes() : grid.size_in_bytes(); }
+
+    color value(double u, double v, const point3& p) const override {
+        return filtered_value(u, v, p, 0);
+    }
+
+    color filtered_value(double u, double v, const point3& p, double footprint) const override {
+        if (atlas) {
+            u = interval(0,1).clamp(u);
+            v = 1.0 - interval(0,1).clamp(v);
+            auto lod = 0.0;
+            if (footprint > 0)
+                lod = std::log2(footprint * std::max(mips.level_width(0), mips.level_height(0)));
+            return mips.trilinear(u, v, lod);
+        }
+
+        if (!bounds.x.contains(p.x()) || !bounds.y.contains(p.y()) || !bounds.z.contains(p.z()))
+            return source->filtered_value(u, v, p, footprint);
+        return trilinear(p);
+    }
+
+    bool needs_uv() const override { return atlas || source->needs_uv(); }
+
+  private:
+    shared_ptr<texture> source;
+    bool atlas = false;
+
+    // 3D grid
+    aabb bounds;
+    real cell = 1;      // Width of a grid cell
+    int cells[3] = {};  // Grid cells along x, y and z
+    texture_storage grid;
+
+    // (u,v) atlas
+    mipmap mips;
+
+    static void store(float* rgb, const color& c) {
+        rgb[0] = float(c.x());
+        rgb[1] = float(c.y());
+        rgb[2] = float(c.z());
+    }
+
+    // Calls sample(row) for every row in [0,count), spread over the hardware threads.
+    template <typename Sample>
+    static void sample_rows(int count, const Sample& sample) {
+        std::atomic<int> next{0};
+        auto work = [&] {
+            for (int row = next++; row < count; row = next++)
+                sample(row);
+        };
+
+        unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < thread_count && int(i) < count; i++)
+            workers.emplace_back(work);
+        work();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    color trilinear(const point3& p) const {
+        // Cell centers sit at half-integer grid coordinates; neighbors clamp to the edges.
+        auto fx = (p.x() - bounds.x.min) / cell - 0.5;
+        auto fy = (p.y() - bounds.y.min) / cell - 0.5;
+        auto fz = (p.z() - bounds.z.min) / cell - 0.5;
+        auto i = int(std::floor(fx)), j = int(std::floor(fy)), k = int(std::floor(fz));
+        auto tx = fx - i, ty = fy - j, tz = fz - k;
+
+        int x0 = std::clamp(i, 0, cells[0] - 1), x1 = std::clamp(i + 1, 0, cells[0] - 1);
+        int y0 = std::clamp(j, 0, cells[1] - 1), y1 = std::clamp(j + 1, 0, cells[1] - 1);
+        int z0 = std::clamp(k, 0, cells[2] - 1), z1 = std::clamp(k + 1, 0, cells[2] - 1);
+
+        // Rows of the storage: slice z holds rows z*cells[1] up to (z+1)*cells[1].
+        auto plane = [&](int z) {
+            int row0 = z * cells[1] + y0, row1 = z * cells[1] + y1;
+            auto near_y = (1-tx)*grid.texel(x0, row0) + tx*grid.texel(x1, row0);
+            auto far_y = (1-tx)*grid.texel(x0, row1) + tx*grid.texel(x1, row1);
+            return (1-ty)*near_y + ty*far_y;
+        };
+        return (1-tz)*plane(z0) + tz*plane(z1);
+    }
+};
+
+#endif
@@ -0,0 +1,449 @@
+// This file defines bidirectional_tracer, which estimates the light of a camera ray by
+// bidirectional path tracing (Veach, "Robust Monte Carlo Methods for Light Transport
+// Simulation", ch. 10). Besides the path from the camera it traces a path from a light,
+// then joins every vertex of one to every vertex of the other by a shadow ray. Each way of
+// building a path this way is a sampling strategy of its own, and multiple importance
+// sampling weighs them, so light that the camera's path alone rarely finds (through glass
+// into fog, or from a light behind glass) comes from the strategies that find it easily.
+// Light paths that reach the camera directly land on whichever pixel they hit, so these
+// are returned as splats for the renderer to add to its image.
+//
+// Vertices keep the densities with which either path would pick them per unit area, to
+// weigh the strategies against each other without tracing them (the bookkeeping of Pharr,
+// Jakob and Humphreys, "Physically Based Rendering", 3rd ed., 16.3). Directions are picked
+// and weighed through the materials' shade_scatter(), shade_pdf() and shade_eval(), and
+// rays through media scatter as in the camera's paths. Light from the background or the
+// environment is only found by the camera's path.
+
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "rtweekend.h"
+#include "environment.h"
+#include "hittable.h"
+#include "light_list.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <vector>
+
+// The camera as light paths see it: a pinhole at origin and the image it sees, a grid of
+// width by height pixels on a plane in front of it.
+struct camera_view {
+    point3 origin;
+    vec3 forward;         // Unit vector toward the image plane
+    point3 upper_left;    // Corner of the image on the plane
+    vec3 pixel_u, pixel_v;  // Steps between pixels on the plane
+    int width, height;
+    double pixel_spread;  // Angle subtended by one pixel, for texture footprints
+    bool pinhole;         // Whether every camera ray starts at origin (no defocus blur)
+};
+
+// Light that a light path brings to pixel (i, j), to add to its sum of samples.
+struct splat {
+    int i, j;
+    color value;
+};
+
+class bidirectional_tracer {
+  public:
+    // lights may be null, leaving only the camera's paths. power_heuristic picks between
+    // the power and balance heuristics for weighing strategies.
+    bidirectional_tracer(const hittable& world, const light_list* lights, const camera_view& view,
+                         int max_depth, bool power_heuristic, const color& background,
+                         const environment* env)
+      : world(world), lights(lights && !lights->empty() ? lights : nullptr), view(view),
+        max_depth(max_depth), power_heuristic(power_heuristic), background(background), env(env)
+    {
+        auto plane = dot(view.upper_left - view.origin, view.forward);
+        image_area = view.width * view.pixel_u.length() * view.height * view.pixel_v.length()
+                   / (plane * plane);
+    }
+
+    // Returns the light arriving along r, a camera ray, and adds the light of the light
+    // path that reaches the camera directly to splats, scaled for a pixel's sum of samples.
+    // The random choices of both paths are drawn from samples.
+    color trace(const ray& r, sampler& samples, std::vector<splat>& splats) {
+        color result(0,0,0);
+
+        camera_path.clear();
+        vertex eye;
+        eye.kind = vertex_kind::camera;
+        eye.rec.p = r.origin();
+        eye.beta = color(1,1,1);
+        eye.time = r.time();
+        camera_path.push_back(eye);
+        result += walk(r, color(1,1,1), camera_pdf(r.direction()), samples, camera_path,
+                       max_depth + 1, true);
+
+        light_path.clear();
+        light_emission e;
+        auto pick = samples.get_1d();
+        auto point = samples.get_2d();
+        auto direction = samples.get_2d();
+        if (lights && lights->emit(pick, point, direction, r.time(), e)) {
+            vertex source;
+            source.kind = vertex_kind::light;
+            source.rec.p = e.r.origin();
+            source.rec.normal = e.normal;
+            source.radiance = e.radiance;
+            source.source = e.source;
+            source.time = r.time();
+            source.beta = color(1,1,1) / e.pdf_point;
+            source.pdf_fwd = e.pdf_point;
+            light_path.push_back(source);
+            walk(e.r, e.flux(), e.pdf_direction, samples, light_path, max_depth, false);
+        }
+
+        for (int t = 1; t <= int(camera_path.size()); t++) {
+            for (int s = 0; s <= int(light_path.size()); s++) {
+                if (s + t - 1 > max_depth || s + t < 2) continue;
+                if (t == 1) {
+                    if (s > 0 && view.pinhole) connect_to_camera(s, samples, splats);
+                } else {
+                    result += connect(s, t, samples);
+                }
+            }
+        }
+        return result;
+    }
+
+  private:
+    enum class vertex_kind : unsigned char { camera, light, surface, medium };
+
+    struct vertex {
+        vertex_kind kind = vertex_kind::surface;
+        hit_record rec{};  // Point, normal (facing the side the path arrived from) and surface
+        const material_record* shading = nullptr;
+        point3 from;     // Point the path arrived from
+        double time = 0;
+        color beta;      // Light (or importance) carried to this vertex over its density
+        color radiance;  // Light emitted, for light vertices
+        const material* source = nullptr;  // Material of a light vertex
+        double pdf_fwd = 0;  // Density of this vertex per unit area, picked by its own path
+        double pdf_rev = 0;  // Same, picked by the other path traced the other way
+        bool delta = false;  // Scatters into a single direction, so can't be joined
+
+        const point3& p() const { return rec.p; }
+
+        bool on_surface() const {
+            return kind == vertex_kind::surface || kind == vertex_kind::light;
+        }
+
+        // Whether a shadow ray can join this vertex to another one.
+        bool connectible() const {
+            return kind == vertex_kind::camera || kind == vertex_kind::light || !delta;
+        }
+    };
+
+    const hittable& world;
+    const light_list* lights;
+    camera_view view;
+    int max_depth;
+    bool power_heuristic;
+    color background;
+    const environment* env;
+    double image_area;  // Area of the image on a plane at unit distance from the camera
+
+    std::vector<vertex> camera_path, light_path;
+
+    // Follows r from the last vertex of path, adding a vertex at each hit until path has
+    // max_vertices. beta is the light or importance carried along r over its density, and
+    // pdf the density of r's direction per unit solid angle. Returns the light of the
+    // background the camera's path finds when it leaves the scene.
+    color walk(ray r, color beta, double pdf, sampler& samples, std::vector<vertex>& path,
+               int max_vertices, bool from_camera) {
+        double cone_width = 0;
+        while (int(path.size()) < max_vertices) {
+            hit_record rec;
+            rec.samples = &samples;
+            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                if (!from_camera) return color(0,0,0);
+                return beta * (env ? env->radiance(r.direction()) : background);
+            }
+            rec.object->compute_surface(r, rec);
+
+            // Light paths have no footprint to filter textures over; they read the finest level.
+            auto footprint = cone_width + view.pixel_spread * rec.t * r.direction().length();
+            rec.uv_footprint = from_camera ? footprint * rec.uv_scale : 0;
+            cone_width = footprint;
+
+            vertex v;
+            v.rec = rec;
+            v.shading = rec.shading ? rec.shading : &rec.mat->record();
+            v.kind = v.shading->kind == material_kind::isotropic ? vertex_kind::medium
+                                                                : vertex_kind::surface;
+            v.from = r.origin();
+            v.time = r.time();
+            v.beta = beta;
+            v.pdf_fwd = convert(pdf, path.back(), v);
+            path.push_back(v);
+            if (int(path.size()) >= max_vertices) break;
+
+            // The same draws per bounce as the camera's paths.
+            auto direction = samples.get_2d();
+            rec.sample[0] = direction.u;
+            rec.sample[1] = direction.v;
+            rec.sample[2] = samples.get_1d();
+
+            color attenuation;
+            ray scattered;
+            auto& current = path.back();
+            auto& previous = path[path.size() - 2];
+            if (!shade_scatter(*current.shading, r, rec, attenuation, scattered))
+                break;
+
+            pdf = shade_pdf(*current.shading, r, rec, scattered.direction());
+            double pdf_reverse = 0;
+            if (pdf <= 0) {
+                current.delta = true;
+                pdf = 0;
+                beta = beta * attenuation;
+            } else {
+                ray back(rec.p, -scattered.direction(), r.time());
+                pdf_reverse = shade_pdf(*current.shading, back, rec, -r.direction());
+                beta = from_camera ? beta * attenuation
+                                   : beta * adjoint_eval(current, scattered.direction()) / pdf;
+            }
+            previous.pdf_rev = convert(pdf_reverse, current, previous);
+
+            if (beta.near_zero()) break;
+            r = scattered;
+        }
+        return color(0,0,0);
+    }
+
+    // Converts the density of the direction from one vertex to another per unit solid angle
+    // into the density of the second vertex per unit area.
+    static double convert(double pdf, const vertex& from, const vertex& to) {
+        auto offset = to.p() - from.p();
+        auto distance_squared = offset.length_squared();
+        if (distance_squared <= 0) return 0;
+        if (to.on_surface())
+            pdf *= std::fabs(dot(to.rec.normal, offset)) / std::sqrt(distance_squared);
+        return pdf / distance_squared;
+    }
+
+    // The density with which the camera picks a ray in direction, per unit solid angle: rays
+    // spread uniformly over the image plane, which a unit solid angle meets over an area
+    // growing with the cube of the angle from the view axis.
+    double camera_pdf(const vec3& direction) const {
+        auto cosine = dot(unit_vector(direction), view.forward);
+        if (cosine <= 0) return 0;
+        int i, j;
+        if (view.pinhole && !raster(view.origin + direction, i, j)) return 0;
+        return 1 / (image_area * cosine*cosine*cosine);
+    }
+
+    // The pixel the camera sees p in. Returns false if p is outside the image.
+    bool raster(const point3& p, int& i, int& j) const {
+        auto d = p - view.origin;
+        auto along = dot(d, view.forward);
+        if (along <= 0) return false;
+        auto plane = dot(view.upper_left - view.origin, view.forward);
+        auto on_plane = view.origin + d * (plane / along) - view.upper_left;
+        auto x = dot(on_plane, view.pixel_u) / view.pixel_u.length_squared();
+        auto y = dot(on_plane, view.pixel_v) / view.pixel_v.length_squared();
+        if (x < 0 || y < 0 || x >= view.width || y >= view.height) return false;
+        i = int(x);
+        j = int(y);
+        return true;
+    }
+
+    // The light leaving v toward direction that arrived at v from the light's side: the
+    // material's scattering times the cosine at v toward direction. The materials' eval()
+    // takes the direction of the camera's side first, so materials that aren't symmetric in
+    // their two directions have the cosines swapped.
+    color adjoint_eval(const vertex& v, const vec3& direction) const {
+        if (v.kind == vertex_kind::light) {
+            auto cosine = dot(v.rec.normal, unit_vector(direction));
+            return cosine > 0 ? v.radiance * cosine : color(0,0,0);
+        }
+
+        auto toward_light = v.from - v.p();
+        const auto& m = *v.shading;
+        if (m.kind == material_kind::lambertian || m.kind == material_kind::isotropic)
+            return shade_eval(m, ray(v.from, -toward_light, v.time), v.rec, direction);
+
+        auto f = shade_eval(m, ray(v.p(), -direction, v.time), v.rec, toward_light);
+        auto cos_in = std::fabs(dot(v.rec.normal, unit_vector(toward_light)));
+        auto cos_out = std::fabs(dot(v.rec.normal, unit_vector(direction)));
+        return cos_in > 0 ? f * (cos_out / cos_in) : color(0,0,0);
+    }
+
+    // The light leaving camera path vertex v toward direction, per unit light arriving
+    // from direction: the material's scattering times the cosine at v.
+    static color camera_eval(const vertex& v, const vec3& direction) {
+        return shade_eval(*v.shading, ray(v.from, v.p() - v.from, v.time), v.rec, direction);
+    }
+
+    // The density, per unit area, with which v picks next, having been reached from prev
+    // (null if v starts its path).
+    double pdf(const vertex& v, const vertex* prev, const vertex& next) const {
+        auto direction = next.p() - v.p();
+        double pdf_direction = 0;
+        if (v.kind == vertex_kind::camera) {
+            pdf_direction = camera_pdf(direction);
+        } else if (!prev) {
+            double pdf_point;
+            vec3 normal;
+            auto source = v.source ? v.source : v.shading->source;
+            if (!lights || !lights->emit_pdf(ray(v.p(), direction, v.time), source, pdf_point,
+                                             pdf_direction, normal))
+                return 0;
+        } else {
+            ray in(prev->p(), v.p() - prev->p(), v.time);
+            pdf_direction = shade_pdf(*v.shading, in, v.rec, direction);
+        }
+        return convert(pdf_direction, v, next);
+    }
+
+    // The density per unit area with which a light path starts at v, a point on a light.
+    double light_origin_pdf(const vertex& v, const vertex& toward) const {
+        double pdf_point, pdf_direction;
+        vec3 normal;
+        auto source = v.source ? v.source : v.shading->source;
+        if (!lights || !lights->emit_pdf(ray(v.p(), toward.p() - v.p(), v.time), source,
+                                         pdf_point, pdf_direction, normal))
+            return 0;
+        return pdf_point;
+    }
+
+    // Whether nothing blocks the segment between a and b. Media on it draw from samples.
+    bool visible(const vertex& a, const vertex& b, sampler& samples) const {
+        auto offset = b.p() - a.p();
+        auto distance = offset.length();
+        ray shadow(a.p(), offset / distance, a.time);
+        return !world.occluded(shadow, interval(0.001, distance - 0.001), &samples);
+    }
+
+    // The light of the path made of the first s vertices of the light path and the first t
+    // of the camera path (t >= 2), weighted against the other ways of making it.
+    color connect(int s, int t, sampler& samples) {
+        auto& pt = camera_path[t-1];
+        if (s == 0) {
+            // The camera's path found a light itself.
+            if (pt.kind != vertex_kind::surface || !pt.shading->emissive) return color(0,0,0);
+            auto emitted = shade_emitted(*pt.shading, pt.rec);
+            if (emitted.near_zero()) return color(0,0,0);
+            return pt.beta * emitted * weight(s, t, nullptr);
+        }
+        if (!pt.connectible()) return color(0,0,0);
+
+        if (s == 1) {
+            // A fresh point on a light, picked toward pt.
+            auto pick = samples.get_1d();
+            auto point = samples.get_2d();
+            light_sample ls;
+            if (!lights->sample(pt.p(), pt.time, pick, point, ls)) return color(0,0,0);
+
+            vertex sampled;
+            sampled.kind = vertex_kind::light;
+            sampled.rec.p = pt.p() + ls.distance * ls.direction;
+            sampled.radiance = ls.radiance;
+            sampled.source = ls.source;
+            sampled.time = pt.time;
+            double pdf_direction;
+            ray out(sampled.p(), -ls.direction, pt.time);
+            if (!lights->emit_pdf(out, ls.source, sampled.pdf_fwd, pdf_direction, sampled.rec.normal))
+                return color(0,0,0);
+
+            auto f = camera_eval(pt, ls.direction);
+            if (f.near_zero() || !visible(pt, sampled, samples)) return color(0,0,0);
+            auto light = pt.beta * f * ls.radiance / ls.pdf;
+            return light * weight(s, t, &sampled);
+        }
+
+        auto& qs = light_path[s-1];
+        if (!qs.connectible()) return color(0,0,0);
+
+        auto offset = qs.p() - pt.p();
+        auto f = camera_eval(pt, offset) * adjoint_eval(qs, -offset);
+        if (f.near_zero() || !visible(pt, qs, samples)) return color(0,0,0);
+        auto light = pt.beta * f * qs.beta / offset.length_squared();
+        return light * weight(s, t, nullptr);
+    }
+
+    // Joins the first s vertices of the light path to the camera, splatting the light they
+    // bring onto the pixel they're seen in. Every camera sample traces a light path, so a
+    // pixel's sum gets its fraction of the light of all of them: the light reaching the
+    // camera per unit solid angle, over the pixel's solid angle. That is camera_pdf() times
+    // the pixel count, which cancels against the pixel count of the samples.
+    void connect_to_camera(int s, sampler& samples, std::vector<splat>& splats) {
+        auto& qs = light_path[s-1];
+        if (!qs.connectible()) return;
+
+        int i, j;
+        if (!raster(qs.p(), i, j)) return;
+
+        auto offset = view.origin - qs.p();
+        auto f = adjoint_eval(qs, offset);
+        if (f.near_zero() || !visible(qs, camera_path[0], samples)) return;
+
+        auto light = qs.beta * f * camera_pdf(-offset) / offset.length_squared();
+        splats.push_back({i, j, light * weight(s, 1, nullptr)});
+    }
+
+    // The weight of the strategy joining s light path vertices to t camera path vertices,
+    // among all strategies making the same path: the density of this one over the sum of
+    // all of them, in ratios of neighbours' densities. sampled replaces the light path's
+    // first vertex if s is 1. The vertices at the join are temporarily given the densities
+    // of the other path reaching them.
+    double weight(int s, int t, const vertex* sampled) {
+        if (s + t == 2) return 1;
+
+        vertex saved_light;
+        if (s == 1) {
+            saved_light = light_path[0];
+            light_path[0] = *sampled;
+        }
+
+        vertex* qs = s > 0 ? &light_path[s-1] : nullptr;
+        vertex* pt = &camera_path[t-1];
+        vertex* qs_minus = s > 1 ? &light_path[s-2] : nullptr;
+        vertex* pt_minus = t > 1 ? &camera_path[t-2] : nullptr;
+
+        struct saved { vertex* v; double pdf_rev; bool delta; };
+        saved changed[4];
+        int count = 0;
+        for (auto v : {qs, pt, qs_minus, pt_minus})
+            if (v) changed[count++] = {v, v->pdf_rev, v->delta};
+
+        pt->pdf_rev = qs ? pdf(*qs, qs_minus, *pt) : light_origin_pdf(*pt, *pt_minus);
+        if (pt_minus)
+            pt_minus->pdf_rev = qs ? pdf(*pt, qs, *pt_minus) : pdf(*pt, nullptr, *pt_minus);
+        if (qs) qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+        if (qs_minus) qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+        pt->delta = false;
+        if (qs) qs->delta = false;
+
+        auto ratio = [&](double numerator, double denominator) {
+            auto r = (numerator != 0 ? numerator : 1) / (denominator != 0 ? denominator : 1);
+            return power_heuristic ? r*r : r;
+        };
+
+        // Strategies with more camera path vertices, then with more light path vertices.
+        // Camera paths with a lens can't be joined to from light paths (t = 1).
+        double sum = 0, r = 1;
+        int min_t = view.pinhole ? 1 : 2;
+        for (int i = t - 1; i >= min_t; i--) {
+            r *= ratio(camera_path[i].pdf_rev, camera_path[i].pdf_fwd);
+            if (!camera_path[i].delta && !camera_path[i-1].delta) sum += r;
+        }
+        r = 1;
+        for (int i = s - 1; i >= 0; i--) {
+            r *= ratio(light_path[i].pdf_rev, light_path[i].pdf_fwd);
+            if (!light_path[i].delta && !(i > 0 && light_path[i-1].delta)) sum += r;
+        }
+
+        for (int k = 0; k < count; k++) {
+            changed[k].v->pdf_rev = changed[k].pdf_rev;
+            changed[k].v->delta = changed[k].delta;
+        }
+        if (s == 1) light_path[0] = saved_light;
+        return 1 / (1 + sum);
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+import os
+import subprocess
+import sys
+import tempfile
+import time
+import argparse
+
+
+# Variants to compare: extra compiler flags and environment settings for the run.
+# The first variant given is the reference for the image error.
+VARIANTS = {
+    "double":  {"flags": []},
+    "float":   {"flags": ["-DRTW_USE_FLOAT"]},
+    "simd":    {"flags": ["-DRTW_USE_SIMD"]},
+    "objects": {"flags": [], "env": {"RTW_SPHERE_SET": "0"}},  # One object per small sphere
+    "graph":   {"flags": [], "env": {"RTW_COMPILE_SCENE": "0"}},  # Traverse the scene graph directly
+    "nearest": {"flags": [], "env": {"RTW_TEXTURE_FILTER": "nearest"}},  # Unfiltered image textures
+    "half":    {"flags": [], "env": {"RTW_TEXTURE_FORMAT": "half"}},  # Texture storage formats
+    "bc1":     {"flags": [], "env": {"RTW_TEXTURE_FORMAT": "bc1"}},
+    "tiled":   {"flags": [], "env": {"RTW_TILED_TEXTURES": "1",  # Textures paged from tile files
+                                     "RTW_TILE_DIR": tempfile.gettempdir()}},
+    "baked":   {"flags": [], "env": {"RTW_BAKE_RESOLUTION": "64"}},  # Noise baked into a grid
+    "paths":   {"flags": [], "env": {"RTW_SAMPLE_LIGHTS": "0"}},  # Lights found only by bounces
+    "random":  {"flags": [], "env": {"RTW_SAMPLER": "independent"}},  # Path samplers
+    "strata":  {"flags": [], "env": {"RTW_SAMPLER": "stratified"}},
+    "uniform": {"flags": [], "env": {"RTW_LIGHT_SELECTION": "uniform"}},  # Light picking
+    "power":   {"flags": [], "env": {"RTW_LIGHT_SELECTION": "power"}},
+    "lightbvh": {"flags": [], "env": {"RTW_LIGHT_SELECTION": "bvh"}},
+    "guided":  {"flags": [], "env": {"RTW_GUIDING": "1"}},  # Bounces guided by a learned SD-tree
+    "caustics": {"flags": [], "env": {"RTW_CAUSTICS": "1"}},  # Caustics from a photon map
+    "progressive": {"flags": [], "env": {"RTW_CAUSTICS": "1", "RTW_PHOTON_PASSES": "4"}},
+    "bdpt":    {"flags": [], "env": {"RTW_BDPT": "1"}},  # Bidirectional path tracing
+    "mlt":     {"flags": [], "env": {"RTW_METROPOLIS": "1"}},  # Metropolis light transport
+}
+
+SCENE_NAMES = {
+    1: "bouncing_spheres", 2: "checkered_spheres", 3: "earth", 4: "perlin_spheres",
+    5: "quads", 6: "triangle_scene", 7: "simple_light", 8: "cornell_box",
+    9: "cornell_smoke", 10: "final_scene", 12: "many_lights", 13: "environment_lit",
+}
+
+
+def build(name, flags, out_dir):
+    # Compile main.cc with the given extra flags and return the path of the executable.
+    exe = os.path.join(out_dir, "bench_" + name)
+    cmd = ["g++", "-std=c++17", "-O2"] + flags + ["main.cc", "stb_image.cc", "-o", exe]
+    print(f"Building {name}: {' '.join(cmd)}")
+    subprocess.run(cmd, check=True, stderr=subprocess.DEVNULL)
+    return exe
+
+
+def render(exe, scene, width, samples, extra_env, ppm_path):
+    # Render one scene to a PPM file and return the wall-clock time in seconds.
+    env = dict(os.environ, RTW_WIDTH=str(width), RTW_SAMPLES=str(samples))
+    env.update(extra_env)
+    start = time.perf_counter()
+    with open(ppm_path, "w") as out:
+        subprocess.run([exe, str(scene)], stdout=out, stderr=subprocess.DEVNULL, env=env, check=True)
+    return time.perf_counter() - start
+
+
+def read_ppm(ppm_path):
+    # Read the plain (P3) PPM files written by the renderer.
+    with open(ppm_path) as f:
+        tokens = f.read().split()
+    return [int(t) for t in tokens[4:]]
+
+
+def rms_error(a, b):
+    if len(a) != len(b) or not a:
+        return float("nan")
+    return (sum((x - y) ** 2 for x, y in zip(a, b)) / len(a)) ** 0.5
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare speed and image error of build variants.")
+    parser.add_argument("--scenes", type=int, nargs="+", default=[1, 4, 8, 10])
+    parser.add_argument("--variants", nargs="+", default=list(VARIANTS))
+    parser.add_argument("--width", type=int, default=200)
+    parser.add_argument("--samples", type=int, default=20)
+    args = parser.parse_args()
+
+    out_dir = tempfile.mkdtemp(prefix="rtw_bench_")
+    exes = {name: build(name, VARIANTS[name]["flags"], out_dir) for name in args.variants}
+    reference = args.variants[0]
+
+    print(f"\n{'scene':<20}{'variant':<12}{'time (s)':>10}{'speedup':>10}{'RMS error':>12}")
+    for scene in args.scenes:
+        ref_time, ref_pixels = None, None
+        for name in args.variants:
+            ppm_path = os.path.join(out_dir, f"{name}_{scene}.ppm")
+            seconds = render(exes[name], scene, args.width, args.samples,
+                             VARIANTS[name].get("env", {}), ppm_path)
+            pixels = read_ppm(ppm_path)
+            if name == reference:
+                ref_time, ref_pixels = seconds, pixels
+            error = rms_error(ref_pixels, pixels)
+            print(f"{SCENE_NAMES.get(scene, scene):<20}{name:<12}{seconds:>10.2f}"
+                  f"{ref_time / seconds:>10.2f}{error:>12.2f}")
+
+    print(f"\nImages are in {out_dir} (RMS error is in 8-bit levels against '{reference}').")
+
+
+if __name__ == "__main__":
+    if not os.path.exists("main.cc"):
+        print("Usage: run benchmark.py from the book2_code directory")
+        sys.exit(1)
+    main()
@@ -55,6 +55,39 @@ class bvh_node : public hittable {
         return hit_left || hit_right;
     }
 
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        return left->occluded(r, ray_t, samples)
+            || (right != left && right->occluded(r, ray_t, samples));
+    }
+
+    bool hit_span(const ray& r, interval ray_t, interval& span) const override {
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        interval left_span, right_span;
+        bool hit_left = left->hit_span(r, ray_t, left_span);
+        bool hit_right = right != left && right->hit_span(r, ray_t, right_span);
+
+        if (hit_left && hit_right)
+            span = interval(left_span, right_span);
+        else if (hit_left)
+            span = left_span;
+        else if (hit_right)
+            span = right_span;
+
+        return hit_left || hit_right;
+    }
+
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        compiler.add_object(*left, to_world);
+        if (right != left)
+            compiler.add_object(*right, to_world);
+        return true;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
   private:
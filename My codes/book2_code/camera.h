@@ -6,11 +6,28 @@
 #define CAMERA_H
 
 #include "rtweekend.h"
+#include "bdpt.h"
 #include "color.h"
+#include "environment.h"
+#include "flat_scene.h"
 #include "hittable.h"
+#include "light_list.h"
 #include "material.h"
+#include "metropolis.h"
+#include "path_guide.h"
+#include "photon_map.h"
+#include "sampler.h"
+#include <cstring>
 #include <iostream>
 
+// How the direct light found by light samples and by scattered rays that hit lights is
+// combined (multiple importance sampling, see camera::ray_color).
+enum class mis_heuristic {
+    none,     // Light samples only; scattered rays skip the sampled lights they hit
+    balance,  // Each sample weighted by its density over the sum of both densities
+    power     // Same with squared densities, favoring the more confident strategy further
+};
+
 // Represents the virtual camera from which rays are cast.
 class camera {
   public:
@@ -19,6 +36,7 @@ class camera {
     int    samples_per_pixel = 10;   // Count of random samples for each pixel
     int    max_depth = 10;   // Maximum number of ray bounces
     color  background;               // Scene background color
+    shared_ptr<environment> environment_map;  // Light around the scene, replacing background
 
     double vfov = 90;
     point3 lookfrom = point3(0,0,0);
@@ -28,25 +46,87 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    bool compile_scene = true;  // Render a flat_scene compiled from the world (see flat_scene.h)
+    bool sample_lights = true;  // Sample the scene's lights and environment directly at hits
+    mis_heuristic mis = mis_heuristic::power;  // Weighting of light samples against scattering
+    light_selection select_lights = light_selection::automatic;  // Which light a sample goes to
+    sampler_kind sampling = sampler_kind::sobol;  // How each path's random numbers are picked
+    bool guide_paths = false;  // Learn where light comes from and guide bounces (path_guide.h)
+    bool map_caustics = false;  // Render caustics from a photon map (photon_map.h)
+    int  caustic_photons = 100000;  // Photons stored per map, bounding its memory
+    double photon_radius = 2;  // Radius photons are gathered from, in pixel footprints
+    int  photon_passes = 1;    // Photon maps traced, one per pass, with shrinking radius
+    bool bidirectional = false;  // Join camera paths to paths from the lights (bdpt.h)
+    bool metropolis = false;   // Explore bright paths by Markov chains (metropolis.h)
+
     // Renders the scene and writes the output to a PPM stream.
-    void render(const hittable& world) {
+    void render(const hittable& scene_graph) {
         initialize();
 
+        // Decode the scene's images in parallel now rather than one by one on first hit.
+        texture_registry::global().load_all();
+
+        const hittable* world_ptr = &scene_graph;
+        std::unique_ptr<flat_scene> compiled;
+        if (compile_scene) {
+            compiled = std::make_unique<flat_scene>(scene_graph);
+            world_ptr = compiled.get();
+        }
+        const hittable& world = *world_ptr;
+
+        light_list scene_lights(scene_graph, select_lights);
+        lights = (sample_lights && !scene_lights.empty()) ? &scene_lights : nullptr;
+        sampled_environment = sample_lights ? environment_map.get() : nullptr;
+
+        // With both kinds of light, half the light samples go to the environment.
+        environment_share = !sampled_environment ? 0.0 : lights ? 0.5 : 1.0;
+        auto samples = make_sampler(sampling, samples_per_pixel);
+
         std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
+        if (bidirectional) {
+            render_bidirectional(world, *samples);
+            lights = nullptr;
+            sampled_environment = nullptr;
+            return;
+        }
+
+        if (metropolis) {
+            render_metropolis(world);
+            lights = nullptr;
+            sampled_environment = nullptr;
+            return;
+        }
+
+        if (guide_paths || map_caustics) {
+            path_guide paths(scene_graph.bounding_box());
+            photon_map photons(scene_graph, scene_lights, background, environment_map.get());
+            guide = guide_paths ? &paths : nullptr;
+            caustics = map_caustics ? &photons : nullptr;
+            render_passes(world, *samples);
+            guide = nullptr;
+            caustics = nullptr;
+            lights = nullptr;
+            sampled_environment = nullptr;
+            return;
+        }
+
         for (int j = 0; j < image_height; ++j) {
             std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
             for (int i = 0; i < image_width; ++i) {
                 color pixel_color(0,0,0);
                 for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, world, max_depth);
+                    samples->start_pixel_sample(i, j, sample);
+                    ray r = get_ray(i, j, *samples);
+                    pixel_color += ray_color(r, world, *samples, max_depth);
                 }
                 write_color(std::cout, pixel_color, samples_per_pixel);
             }
         }
 
         std::clog << "\rDone.\n";
+        lights = nullptr;
+        sampled_environment = nullptr;
     }
 
   private:
@@ -57,9 +137,57 @@ class camera {
     vec3   u, v, w;        // Camera frame basis vectors
     vec3   defocus_disk_u;  // Defocus disk horizontal radius
     vec3   defocus_disk_v;  // Defocus disk vertical radius
+    double pixel_spread;   // Angle subtended by one pixel, for texture footprints
+    const light_list* lights = nullptr;  // Lights sampled at hits while rendering
+    const environment* sampled_environment = nullptr;  // Environment sampled at hits
+    double environment_share = 0;  // Fraction of light samples that go to the environment
+    path_guide* guide = nullptr;   // Guide of bounces while rendering with guide_paths
+    bool recording = false;        // Whether paths record their light into guide
+    photon_map* caustics = nullptr;  // Caustic photons while rendering with map_caustics
+    double gather_scale = 1;       // Shrinking of photon_radius over progressive passes
+
+    // Where a path stands with respect to the caustic photon map. Light that a path finds
+    // through specular bounces right after a diffuse one is held by the map, which the
+    // diffuse hit already gathered from, so the path leaves it out.
+    enum class caustic_path : unsigned char {
+        none,      // No diffuse hit since the last non-specular bounce
+        diffuse,   // Just left a diffuse hit
+        specular   // Went through specular bounces since a diffuse hit
+    };
+
+    // Fraction of the bounces in a region with a learned guide that sample the guide. Light
+    // samples already find most direct light, so most bounces still follow the material.
+    static constexpr double guide_share = 0.25;
 
     // Initializes camera parameters based on public settings.
     void initialize() {
+        // Quick, low-quality renders without editing the scenes (used by benchmark.py).
+        if (auto samples = std::getenv("RTW_SAMPLES")) samples_per_pixel = std::atoi(samples);
+        if (auto width = std::getenv("RTW_WIDTH")) image_width = std::atoi(width);
+        if (auto compile = std::getenv("RTW_COMPILE_SCENE")) compile_scene = std::atoi(compile) != 0;
+        if (auto sample = std::getenv("RTW_SAMPLE_LIGHTS")) sample_lights = std::atoi(sample) != 0;
+        if (auto name = std::getenv("RTW_MIS")) {
+            if (std::strcmp(name, "none") == 0) mis = mis_heuristic::none;
+            if (std::strcmp(name, "balance") == 0) mis = mis_heuristic::balance;
+            if (std::strcmp(name, "power") == 0) mis = mis_heuristic::power;
+        }
+        if (auto name = std::getenv("RTW_LIGHT_SELECTION")) {
+            for (auto selection : {light_selection::uniform, light_selection::power,
+                                   light_selection::bvh, light_selection::automatic})
+                if (std::strcmp(name, light_selection_name(selection)) == 0) select_lights = selection;
+        }
+        if (auto guiding = std::getenv("RTW_GUIDING")) guide_paths = std::atoi(guiding) != 0;
+        if (auto map = std::getenv("RTW_CAUSTICS")) map_caustics = std::atoi(map) != 0;
+        if (auto count = std::getenv("RTW_PHOTONS")) caustic_photons = std::atoi(count);
+        if (auto radius = std::getenv("RTW_PHOTON_RADIUS")) photon_radius = std::atof(radius);
+        if (auto passes = std::getenv("RTW_PHOTON_PASSES")) photon_passes = std::atoi(passes);
+        if (auto bdpt = std::getenv("RTW_BDPT")) bidirectional = std::atoi(bdpt) != 0;
+        if (auto mlt = std::getenv("RTW_METROPOLIS")) metropolis = std::atoi(mlt) != 0;
+        if (auto name = std::getenv("RTW_SAMPLER")) {
+            for (auto kind : {sampler_kind::independent, sampler_kind::stratified, sampler_kind::sobol})
+                if (std::strcmp(name, sampler_kind_name(kind)) == 0) sampling = kind;
+        }
+
         image_height = static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
@@ -80,6 +208,7 @@ class camera {
         // Calculate the horizontal and vertical delta vectors from pixel to pixel.
         pixel_delta_u = viewport_u / image_width;
         pixel_delta_v = viewport_v / image_height;
+        pixel_spread = pixel_delta_u.length() / focus_dist;
 
         // Calculate the location of the upper left pixel.
         auto viewport_upper_left = lookfrom - (focus_dist * w) - viewport_u/2 - viewport_v/2;
@@ -91,53 +220,302 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     }
 
-    // Generates a randomly sampled camera ray for the pixel at (i, j).
-    ray get_ray(int i, int j) const {
+    // Generates a camera ray for the pixel at (i, j), through a point of the pixel, from a
+    // point of the lens and at a time drawn from samples, in that order.
+    ray get_ray(int i, int j, sampler& samples) const {
         auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-        auto pixel_sample = pixel_center + pixel_sample_square();
+        auto pixel_sample = pixel_center + pixel_sample_square(samples.get_2d());
 
-        auto ray_origin = (defocus_angle <= 0) ? lookfrom : defocus_disk_sample();
+        auto ray_origin = (defocus_angle <= 0) ? lookfrom : defocus_disk_sample(samples.get_2d());
         auto ray_direction = pixel_sample - ray_origin;
-        auto ray_time = random_double();
+        auto ray_time = samples.get_1d();
 
         return ray(ray_origin, ray_direction, ray_time);
     }
 
-    // Returns a random point in the square surrounding a pixel at the origin.
-    vec3 pixel_sample_square() const {
-        auto px = -0.5 + random_double();
-        auto py = -0.5 + random_double();
+    // Returns the point of the square surrounding a pixel at the origin picked by s.
+    vec3 pixel_sample_square(const sample_2d& s) const {
+        auto px = -0.5 + s.u;
+        auto py = -0.5 + s.v;
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 
-    point3 defocus_disk_sample() const {
-        // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
+    point3 defocus_disk_sample(const sample_2d& s) const {
+        // Returns the point of the camera defocus disk picked by s.
+        auto p = sample_in_unit_disk(s.u, s.v);
         return lookfrom + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    // Calculates the color of a ray.
-    color ray_color(const ray& r, const hittable& world, int depth) const {
+    // Calculates the color of a ray. cone_width is the width of the ray's footprint at its
+    // origin; it grows by pixel_spread per unit distance traveled, like a camera ray's.
+    // scatter_pdf is the density with which the previous hit picked r's direction, or zero
+    // for camera rays and rays scattered into a single direction. Hits that pick from a
+    // spread of directions also take a light sample, and the light r hits is weighted
+    // against it. The random choices at each hit are drawn from samples. state tracks the
+    // path's bounces for the caustic photon map, if any.
+    color ray_color(const ray& r, const hittable& world, sampler& samples, int depth,
+                    double cone_width = 0, double scatter_pdf = 0,
+                    caustic_path state = caustic_path::none) const {
         hit_record rec;
+        rec.samples = &samples;
 
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
             return color(0,0,0);
 
-        // If the ray hits nothing, return the background color.
-        if (!world.hit(r, interval(0.001, infinity), rec))
-            return background;
+        bool in_map = state == caustic_path::specular;
+
+        // If the ray hits nothing, return the background color or the environment's light.
+        if (!world.hit(r, interval(0.001, infinity), rec)) {
+            if (in_map && caustics->covers_sky(r)) return color(0,0,0);
+            if (!environment_map) return background;
+            color radiance = environment_map->radiance(r.direction());
+            if (scatter_pdf > 0 && sampled_environment) {
+                auto light_pdf = environment_share * sampled_environment->pdf(r.direction());
+                radiance *= scatter_weight(scatter_pdf, light_pdf);
+            }
+            return radiance;
+        }
+
+        rec.object->compute_surface(r, rec);
+
+        auto footprint = cone_width + pixel_spread * rec.t * r.direction().length();
+        rec.uv_footprint = footprint * rec.uv_scale;
 
         ray scattered;
         color attenuation;
-        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        const material_record& shading = rec.shading ? *rec.shading : rec.mat->record();
+        color color_from_emission = shade_emitted(shading, rec);
+        if (in_map && caustics->emits(shading.source))
+            color_from_emission = color(0,0,0);
+        if (scatter_pdf > 0 && lights && lights->emits(shading.source)) {
+            auto light_pdf = (1 - environment_share) * lights->pdf(r, rec, shading.source);
+            color_from_emission *= scatter_weight(scatter_pdf, light_pdf);
+        }
+
+        // Every bounce draws the same dimensions, used or not, so that each one makes the
+        // same choice across the samples of a pixel: the scattered direction, then the light
+        // and the point on it.
+        auto direction = samples.get_2d();
+        rec.sample[0] = direction.u;
+        rec.sample[1] = direction.v;
+        rec.sample[2] = samples.get_1d();
+        bool any_lights = lights || sampled_environment;
+        auto light_pick = any_lights ? samples.get_1d() : 0.0;
+        auto light_point = any_lights ? samples.get_2d() : sample_2d{0, 0};
 
-        if (!rec.mat->scatter(r, rec, attenuation, scattered))
+        if (!shade_scatter(shading, r, rec, attenuation, scattered))
             return color_from_emission;
 
-        color color_from_scatter = attenuation * ray_color(scattered, world, depth-1);
+        // Diffuse hits take their caustics from the photon map, gathered over a few pixel
+        // footprints.
+        auto next_state = caustic_path::none;
+        if (caustics && shading.kind == material_kind::lambertian) {
+            auto radius = photon_radius * gather_scale * footprint;
+            color_from_emission += shade_albedo(shading, rec) / pi
+                                 * caustics->irradiance(rec.p, rec.normal, radius);
+            next_state = caustic_path::diffuse;
+        } else if (state != caustic_path::none && is_specular(shading)) {
+            next_state = caustic_path::specular;
+        }
+
+        // Diffuse bounces in a region that has learned where light comes from pick their
+        // direction from the guide or the material by rec.sample[2], and weigh it by the mix
+        // of both densities.
+        guide_region* region = guide && guided(shading) ? guide->find(rec.p) : nullptr;
+        bool mixed = region && region->learned();
+        if (mixed && rec.sample[2] < guide_share)
+            scattered = ray(rec.p, region->sample({rec.sample[0], rec.sample[1]}), r.time());
+
+        auto pdf = (any_lights || region)
+                 ? scatter_density(shading, r, rec, scattered.direction(), region) : 0.0;
+        if (mixed)
+            attenuation = pdf > 0 ? shade_eval(shading, r, rec, scattered.direction()) / pdf
+                                  : color(0,0,0);
+
+        color color_from_lights = any_lights && pdf > 0
+            ? direct_light(shading, r, rec, world, light_pick, light_point, region, samples)
+            : color(0,0,0);
+        if (mixed && attenuation.near_zero())
+            return color_from_emission + color_from_lights;
+
+        color incoming = ray_color(scattered, world, samples, depth-1, footprint, pdf, next_state);
+        if (recording && region)
+            region->record(scattered.direction(), channel_mean(incoming), pdf);
+
+        return color_from_emission + color_from_lights + attenuation * incoming;
+    }
+
+    // Renders in passes and averages them. Training the path guide takes passes of doubling
+    // length, then a last pass with the samples left, which no longer records; every pass
+    // is an unbiased estimate, only noisier while the guide is still coarse. The photon map
+    // is traced before the first pass, or with several photon_passes before each, with a
+    // radius shrinking by the progressive photon mapping rule of Knaus and Zwicker
+    // ("Progressive Photon Mapping: A Probabilistic Approach"), so the blur of the caustics
+    // fades as the passes add up.
+    void render_passes(const hittable& world, sampler& samples) {
+        std::vector<color> pixels(size_t(image_width) * image_height, color(0,0,0));
+        int passes = std::clamp(photon_passes, 1, samples_per_pixel);
+        gather_scale = 1;
+
+        int done = 0, pass = 0;
+        for (int length = 1; done < samples_per_pixel; length *= 2, pass++) {
+            recording = guide && done + 3*length <= samples_per_pixel;
+            auto count = recording ? length : samples_per_pixel - done;
+            if (!guide) count = (samples_per_pixel - done) / (passes - pass);
+
+            if (caustics && (pass == 0 || passes > 1)) {
+                if (pass > 0) gather_scale *= std::sqrt((pass + 2.0/3) / (pass + 1));
+                caustics->trace(world, caustic_photons, uint64_t(pass) + 1);
+            }
+
+            for (int j = 0; j < image_height; ++j) {
+                std::clog << "\rPass of " << count << " samples, scanlines remaining: "
+                          << (image_height - j) << ' ' << std::flush;
+                for (int i = 0; i < image_width; ++i) {
+                    auto& pixel_color = pixels[size_t(j) * image_width + i];
+                    for (int sample = done; sample < done + count; ++sample) {
+                        samples.start_pixel_sample(i, j, sample);
+                        ray r = get_ray(i, j, samples);
+                        pixel_color += ray_color(r, world, samples, max_depth);
+                    }
+                }
+            }
+
+            if (recording) guide->refine(count);
+            done += count;
+        }
+        recording = false;
+
+        for (const auto& pixel_color : pixels)
+            write_color(std::cout, pixel_color, samples_per_pixel);
+        std::clog << "\rDone";
+        if (guide) std::clog << ", guided by " << guide->region_count() << " regions";
+        if (caustics) std::clog << ", " << caustics->size() << " of "
+                                << caustics->emitted_count() << " photons stored";
+        std::clog << ".\n";
+    }
+
+    // Renders by bidirectional path tracing. Light paths reach the camera through pixels
+    // other than the one being sampled, so the image is summed in memory before it's written.
+    void render_bidirectional(const hittable& world, sampler& samples) {
+        camera_view view{lookfrom, -w, pixel00_loc - (pixel_delta_u + pixel_delta_v) / 2,
+                         pixel_delta_u, pixel_delta_v, image_width, image_height, pixel_spread,
+                         defocus_angle <= 0};
+        bidirectional_tracer tracer(world, lights, view, max_depth, mis == mis_heuristic::power,
+                                    background, environment_map.get());
+
+        std::vector<color> pixels(size_t(image_width) * image_height, color(0,0,0));
+        std::vector<splat> splats;
+        for (int j = 0; j < image_height; ++j) {
+            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
+            for (int i = 0; i < image_width; ++i) {
+                for (int sample = 0; sample < samples_per_pixel; ++sample) {
+                    samples.start_pixel_sample(i, j, sample);
+                    ray r = get_ray(i, j, samples);
+                    splats.clear();
+                    pixels[size_t(j) * image_width + i] += tracer.trace(r, samples, splats);
+                    for (const auto& s : splats)
+                        pixels[size_t(s.j) * image_width + s.i] += s.value;
+                }
+            }
+        }
+
+        for (const auto& pixel_color : pixels)
+            write_color(std::cout, pixel_color, samples_per_pixel);
+        std::clog << "\rDone.\n";
+    }
+
+    // Renders by Metropolis light transport, with get_ray() and ray_color() tracing the
+    // paths from the chains' numbers. A path first draws the point of the image it starts
+    // from, so mutations move paths across pixels too; samples_per_pixel counts mutations.
+    void render_metropolis(const hittable& world) {
+        metropolis_integrator integrator(image_width, image_height, [&](sampler& samples) {
+            auto film = samples.get_2d();
+            auto i = std::min(int(film.u * image_width), image_width - 1);
+            auto j = std::min(int(film.v * image_height), image_height - 1);
+            ray r = get_ray(i, j, samples);
+            return path_sample{i, j, ray_color(r, world, samples, max_depth)};
+        });
+
+        for (const auto& pixel_color : integrator.render(samples_per_pixel))
+            write_color(std::cout, pixel_color, samples_per_pixel);
+        std::clog << "\rDone.\n";
+    }
+
+    // Materials whose bounces the guide can steer: those scattering over all directions of
+    // a hemisphere or sphere.
+    static bool guided(const material_record& shading) {
+        return shading.kind == material_kind::lambertian || shading.kind == material_kind::isotropic;
+    }
+
+    // The density of scattering toward direction: the material's own, mixed with region's
+    // guide once it has learned one.
+    double scatter_density(const material_record& shading, const ray& r, const hit_record& rec,
+                           const vec3& direction, const guide_region* region) const {
+        auto pdf = shade_pdf(shading, r, rec, direction);
+        if (!region || !region->learned()) return pdf;
+        return guide_share * region->pdf(direction) + (1 - guide_share) * pdf;
+    }
+
+    static double channel_mean(const color& c) { return (c.x() + c.y() + c.z()) / 3; }
+
+    // Returns the light reaching rec directly from the light point picked by light_pick and
+    // light_point and scattered back along r, weighted against scattering toward that point.
+    // light_pick first decides between the environment and the scene's lights. The light
+    // found is recorded into region while training a path guide. Media the shadow ray
+    // crosses draw from samples.
+    color direct_light(const material_record& shading, const ray& r, const hit_record& rec,
+                       const hittable& world, double light_pick, const sample_2d& light_point,
+                       guide_region* region, sampler& samples) const {
+        light_sample s;
+        if (light_pick < environment_share) {
+            if (!sampled_environment->sample(light_point, s.direction, s.pdf))
+                return color(0,0,0);
+            s.distance = infinity;
+            s.pdf *= environment_share;
+            s.radiance = sampled_environment->radiance(s.direction);
+        } else {
+            auto pick = (light_pick - environment_share) / (1 - environment_share);
+            if (!lights->sample(rec.p, r.time(), pick, light_point, s))
+                return color(0,0,0);
+            s.pdf *= 1 - environment_share;
+        }
+
+        color f = shade_eval(shading, r, rec, s.direction);
+        if (f.near_zero())
+            return color(0,0,0);
+
+        ray shadow(rec.p, s.direction, r.time());
+        if (world.occluded(shadow, interval(0.001, s.distance - 0.001), &samples))
+            return color(0,0,0);
+
+        auto weight = light_weight(s.pdf, scatter_density(shading, r, rec, s.direction, region));
+        if (recording && region)
+            region->record(s.direction, weight * channel_mean(s.radiance), s.pdf);
+        return (weight / s.pdf) * f * s.radiance;
+    }
+
+    // MIS weights of a light sample taken with density light_pdf and of a scattered ray
+    // taken with density scatter_pdf, each given the other strategy's density for it.
 
-        return color_from_emission + color_from_scatter;
+    double light_weight(double light_pdf, double scatter_pdf) const {
+        if (scatter_pdf <= 0 || mis == mis_heuristic::none) return 1;
+        return heuristic(light_pdf, scatter_pdf);
+    }
+
+    double scatter_weight(double scatter_pdf, double light_pdf) const {
+        if (light_pdf <= 0) return 1;
+        if (mis == mis_heuristic::none) return 0;
+        return heuristic(scatter_pdf, light_pdf);
+    }
+
+    double heuristic(double pdf, double other_pdf) const {
+        if (mis == mis_heuristic::power) {
+            pdf *= pdf;
+            other_pdf *= other_pdf;
+        }
+        return pdf / (pdf + other_pdf);
     }
 };
 
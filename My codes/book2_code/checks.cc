@@ -0,0 +1,57 @@
+// Regression checks for cases the rendered scenes don't exercise. Build and run them like
+// the renderer:
+//
+//     g++ -std=c++17 -O2 checks.cc stb_image.cc -o checks && ./checks
+//
+// Each check prints what it found; the program exits with 1 if any of them fails.
+
+#include "rtweekend.h"
+
+#include "flat_scene.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <iostream>
+#include <type_traits>
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+    std::cout << (passed ? "ok      " : "FAILED  ") << what << '\n';
+    if (!passed) failures++;
+}
+
+// Spheres at x = 1, 2, 4, 8, ..., each a quarter as wide as its distance from the origin,
+// leave the surface area heuristic one sphere to split off per level, so the flat scene's
+// BVH would grow as deep as the spheres are many, past its traversal stack.
+static void degenerate_bvh() {
+    // Single precision runs out of range sooner.
+    const int count = std::is_same<real, float>::value ? 120 : 300;
+
+    hittable_list world;
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    double x = 1;
+    for (int i = 0; i < count; i++, x *= 2)
+        world.add(make_shared<sphere>(point3(x, 0, 0), x / 4, white));
+
+    flat_scene scene(world);
+    check(scene.depth() < 64, "degenerate BVH stays within the traversal stack");
+
+    bool all_hit = true, all_occluded = true;
+    x = 1;
+    for (int i = 0; i < count; i++, x *= 2) {
+        ray r(point3(x, 0, -2*x), vec3(0, 0, 1));
+        hit_record rec;
+        all_hit = all_hit && scene.hit(r, interval(0.001, infinity), rec)
+                          && std::fabs(rec.t / x - 1.75) < 1e-4;
+        all_occluded = all_occluded && scene.occluded(r, interval(0.001, infinity), nullptr);
+    }
+    check(all_hit, "every sphere of the degenerate BVH is hit");
+    check(all_occluded, "every sphere of the degenerate BVH occludes");
+}
+
+int main() {
+    degenerate_bvh();
+    return failures ? 1 : 0;
+}
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "sampler.h"
 #include "texture.h"
 
 class constant_medium : public hittable {
@@ -18,38 +19,65 @@ class constant_medium : public hittable {
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record rec1, rec2;
+        double t;
+        if (!free_flight(*boundary, neg_inv_density, r, ray_t, rec.samples, t))
+            return false;
+
+        rec.t = t;
+        rec.object = this;
+
+        return true;
+    }
 
-        if (!boundary->hit(r, interval::universe, rec1))
+    // Samples where r scatters within ray_t in a medium of density -1/neg_inv_density that
+    // fills boundary, storing the ray parameter in t; false if it passes through. The
+    // distance is drawn from samples, the path's own numbers, or from random_double() if it
+    // is null. The flat scene samples its media with this too, with r in the boundary's own
+    // space.
+    static bool free_flight(const hittable& boundary, double neg_inv_density, const ray& r,
+                            interval ray_t, sampler* samples, double& t) {
+        // Find where the ray enters and leaves the boundary in a single query.
+        interval span;
+        if (!boundary.hit_span(r, interval::universe, span))
             return false;
 
-        if (!boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
+        if (span.size() <= 0.0001)
             return false;
 
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+        auto t_enter = span.min;
+        auto t_exit = span.max;
+
+        if (t_enter < ray_t.min) t_enter = ray_t.min;
+        if (t_exit > ray_t.max) t_exit = ray_t.max;
 
-        if (rec1.t >= rec2.t)
+        if (t_enter >= t_exit)
             return false;
 
-        if (rec1.t < 0)
-            rec1.t = 0;
+        if (t_enter < 0)
+            t_enter = 0;
 
         auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * std::log(random_double());
+        auto distance_inside_boundary = (t_exit - t_enter) * ray_length;
+        auto u = samples ? samples->get_1d() : random_double();
+        auto hit_distance = neg_inv_density * std::log(u);
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / ray_length;
+        t = t_enter + hit_distance / ray_length;
+        return true;
+    }
+
+    void compute_surface(const ray& r, hit_record& rec) const override {
         rec.p = r.at(rec.t);
 
         rec.normal = vec3(1,0,0);  // arbitrary
         rec.front_face = true;     // also arbitrary
         rec.mat = phase_function;
+    }
 
-        return true;
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        return compiler.add_medium(*boundary, neg_inv_density, phase_function, to_world);
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
@@ -0,0 +1,127 @@
+// This file defines environment, a light surrounding the scene from infinitely far away,
+// read from an equirectangular HDR image. Rays that leave the scene take its radiance
+// instead of the camera's background color. Small bright features such as the sun carry
+// most of an environment's light, so the renderer samples directions toward it in
+// proportion to its texels' brightness: an alias table over the image rows picks a row and
+// a table per row picks a texel in it (a marginal and conditional distribution).
+
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "rtw_stb_image.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <vector>
+
+class environment {
+  public:
+    // Loads the image; its radiance is multiplied by scale. Columns run once around the
+    // y axis and rows from straight up to straight down, the way sphere textures are mapped
+    // (see sphere::get_sphere_uv). If the image can't be loaded, the environment is black.
+    environment(const char* image_filename, double scale = 1) {
+        rtw_image image(image_filename);
+        width = image.width();
+        height = image.height();
+        if (width <= 0 || height <= 0) {
+            width = height = 1;
+            texels.assign(3, 0.0f);
+        } else {
+            auto data = image.float_data();
+            texels.assign(data, data + 3 * size_t(width) * height);
+            for (auto& t : texels) t *= float(scale);
+        }
+
+        // Texels near the poles cover less solid angle, by the sine of the polar angle.
+        std::vector<double> row_weights(height);
+        for (int y = 0; y < height; y++) {
+            auto sin_theta = std::sin(pi * (y + 0.5) / height);
+            std::vector<double> weights(width);
+            for (int x = 0; x < width; x++) {
+                weights[x] = brightness(texel(x, y)) * sin_theta;
+                row_weights[y] += weights[x];
+            }
+            rows.emplace_back(weights);
+        }
+        marginal = alias_table(row_weights);
+    }
+
+    int image_width() const { return width; }
+    int image_height() const { return height; }
+
+    // The radiance arriving from the given direction.
+    color radiance(const vec3& direction) const {
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        auto x = std::min(int(u * width), width - 1);
+        auto y = std::min(int(v * height), height - 1);
+        return texel(x, y);
+    }
+
+    // Picks a direction by point (uniform numbers in [0,1)) with density over solid angle
+    // pdf, in proportion to the radiance from it. Returns false if the picked texel is black.
+    bool sample(const sample_2d& point, vec3& direction, double& pdf) const {
+        double row_fraction, column_fraction;
+        int y = marginal.sample(point.u, &row_fraction);
+        int x = rows[y].sample(point.v, &column_fraction);
+
+        auto u = (x + column_fraction) / width;
+        auto v = (y + row_fraction) / height;
+        direction = uv_to_direction(u, v);
+        pdf = texel_pdf(x, y, v);
+        return pdf > 0;
+    }
+
+    // The density with which sample() picks the given direction.
+    double pdf(const vec3& direction) const {
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        auto x = std::min(int(u * width), width - 1);
+        auto y = std::min(int(v * height), height - 1);
+        return texel_pdf(x, y, v);
+    }
+
+  private:
+    int width = 0, height = 0;
+    std::vector<float> texels;       // Linear RGB radiance by rows, top row first
+    alias_table marginal;            // Picks a row
+    std::vector<alias_table> rows;   // Picks a texel within each row
+
+    color texel(int x, int y) const {
+        auto t = &texels[3 * (size_t(y) * width + x)];
+        return color(t[0], t[1], t[2]);
+    }
+
+    static double brightness(const color& c) {
+        return std::max(0.0, (c.x() + c.y() + c.z()) / 3.0);
+    }
+
+    // Image coordinates u (around the y axis, from x = -1) and v (down from y = +1) of a
+    // unit direction, both in [0,1].
+    static void direction_to_uv(const vec3& d, double& u, double& v) {
+        auto theta = std::acos(std::clamp(double(d.y()), -1.0, 1.0));
+        auto phi = std::atan2(-d.z(), d.x()) + pi;
+        u = phi / (2*pi);
+        v = theta / pi;
+    }
+
+    static vec3 uv_to_direction(double u, double v) {
+        auto theta = v * pi;
+        auto phi = u * 2*pi;
+        auto sin_theta = std::sin(theta);
+        return vec3(-sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+    }
+
+    // The texel (x, y) covers 2 pi / width by pi / height of the (phi, theta) rectangle, and
+    // a patch of it at v covers sin(pi v) times its area in solid angle.
+    double texel_pdf(int x, int y, double v) const {
+        auto sin_theta = std::sin(pi * v);
+        if (sin_theta <= 0) return 0;
+        auto pmf = marginal.pmf(y) * rows[y].pmf(x);
+        return pmf * width * height / (2*pi*pi * sin_theta);
+    }
+};
+
+#endif
@@ -0,0 +1,538 @@
+// This file defines flat_scene, a compiled form of a scene graph. The hittable tree of
+// lists, BVHs and transforms is flattened into contiguous arrays of world-space primitives
+// of each type (spheres, quads, triangles, media), with one BVH over all of them stored as
+// an array of nodes. Traversal switches on a small type tag instead of making virtual calls.
+
+#ifndef FLAT_SCENE_H
+#define FLAT_SCENE_H
+
+#include "constant_medium.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+class flat_scene : public hittable, public scene_compiler {
+  public:
+    // Compiles the scene graph rooted at world. Objects that can't be flattened are kept as
+    // instances that point back into world, so world must outlive this flat_scene.
+    flat_scene(const hittable& world) {
+        add_object(world, rigid_transform());
+        build();
+    }
+
+    aabb bounding_box() const override { return nodes.empty() ? aabb::empty : nodes[0].bbox; }
+
+    // Levels of the BVH below the root, as built.
+    int depth() const { return tree_depth; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        int stack[max_tree_depth];
+        int stack_size = 0;
+        int node_index = 0;
+
+        while (!nodes.empty()) {
+            const auto& node = nodes[node_index];
+
+            if (node.bbox.hit(r, interval(ray_t.min, closest_so_far))) {
+                if (node.count > 0) {
+                    for (int i = node.start; i < node.start + node.count; i++) {
+                        if (hit_primitive(i, r, interval(ray_t.min, closest_so_far), rec)) {
+                            hit_anything = true;
+                            closest_so_far = rec.t;
+                        }
+                    }
+                } else {
+                    // Visit the child nearer along the split axis first.
+                    bool right_first = r.direction()[node.axis] < 0;
+                    stack[stack_size++] = right_first ? node_index + 1 : node.right;
+                    node_index = right_first ? node.right : node_index + 1;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0) break;
+            node_index = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        int stack[max_tree_depth];
+        int stack_size = 0;
+        int node_index = 0;
+
+        while (!nodes.empty()) {
+            const auto& node = nodes[node_index];
+
+            if (node.bbox.hit(r, ray_t)) {
+                if (node.count > 0) {
+                    for (int i = node.start; i < node.start + node.count; i++) {
+                        if (occludes(i, r, ray_t, samples))
+                            return true;
+                    }
+                } else {
+                    stack[stack_size++] = node.right;
+                    node_index = node_index + 1;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0) break;
+            node_index = stack[--stack_size];
+        }
+
+        return false;
+    }
+
+    void compute_surface(const ray& r, hit_record& rec) const override {
+        const auto& ref = refs[rec.index];
+
+        switch (ref.type) {
+            case prim_type::sphere: {
+                const auto& s = spheres[ref.index];
+                auto center = s.center + r.time()*s.center_vec;
+                rec.p = r.at(rec.t);
+                vec3 outward_normal = (rec.p - center) / s.radius;
+                rec.set_face_normal(r, outward_normal);
+                if (s.uv_needed) {
+                    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+                    rec.uv_scale = sphere::uv_scale(s.radius);
+                }
+                set_material(rec, s.mat);
+                break;
+            }
+            case prim_type::quad: {
+                const auto& q = quads[ref.index];
+                rec.p = r.at(rec.t);
+                rec.set_face_normal(r, q.normal);
+                rec.uv_scale = q.uv_scale;
+                set_material(rec, q.mat);
+                break;
+            }
+            case prim_type::triangle: {
+                const auto& tri = triangles[ref.index];
+                rec.p = r.at(rec.t);
+                rec.set_face_normal(r, tri.normal);
+                rec.uv_scale = tri.uv_scale;
+                set_material(rec, tri.mat);
+                break;
+            }
+            case prim_type::medium: {
+                rec.p = r.at(rec.t);
+                rec.normal = vec3(1,0,0);  // arbitrary
+                rec.front_face = true;     // also arbitrary
+                set_material(rec, media[ref.index].mat);
+                break;
+            }
+            case prim_type::instance:
+                break;  // Transformed instances finish their surface in hit_primitive().
+        }
+    }
+
+    // Scene compiler interface, called while flattening the scene graph.
+
+    void add_object(const hittable& object, const rigid_transform& to_world) override {
+        if (object.flatten(*this, to_world))
+            return;
+
+        instances.push_back({&object, to_world, to_world.is_identity()});
+        auto bbox = object.bounding_box();
+        add_ref(prim_type::instance, instances.size() - 1,
+                instances.back().identity ? bbox : to_world.box(bbox));
+    }
+
+    bool add_sphere(const point3& center, const vec3& center_vec, double radius,
+                    const shared_ptr<material>& mat) override {
+        spheres.push_back({center, center_vec, radius, material_id(mat), mat->needs_uv()});
+
+        auto rvec = vec3(radius, radius, radius);
+        aabb box1(center - rvec, center + rvec);
+        aabb box2(center + center_vec - rvec, center + center_vec + rvec);
+        add_ref(prim_type::sphere, spheres.size() - 1, aabb(box1, box2));
+        return true;
+    }
+
+    bool add_quad(const point3& Q, const vec3& u, const vec3& v,
+                  const shared_ptr<material>& mat) override {
+        auto n = cross(u, v);
+        auto normal = unit_vector(n);
+        quads.push_back({Q, u, v, n / dot(n,n), normal, dot(normal, Q),
+                         1 / std::sqrt(u.length() * v.length()), material_id(mat)});
+        add_ref(prim_type::quad, quads.size() - 1, aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)));
+        return true;
+    }
+
+    bool add_triangle(const point3& Q, const vec3& u, const vec3& v,
+                      const shared_ptr<material>& mat) override {
+        triangles.push_back({Q, u, v, unit_vector(cross(u, v)),
+                             1 / std::sqrt(u.length() * v.length()), material_id(mat)});
+        add_ref(prim_type::triangle, triangles.size() - 1,
+                aabb(aabb(Q, Q + u), aabb(Q, Q + v)));
+        return true;
+    }
+
+    bool add_medium(const hittable& boundary, double neg_inv_density,
+                    const shared_ptr<material>& phase_function,
+                    const rigid_transform& to_world) override {
+        media.push_back({&boundary, to_world, to_world.is_identity(), neg_inv_density,
+                         material_id(phase_function)});
+        auto bbox = boundary.bounding_box();
+        add_ref(prim_type::medium, media.size() - 1,
+                media.back().identity ? bbox : to_world.box(bbox));
+        return true;
+    }
+
+    int primitive_count() const { return int(refs.size()); }
+
+  private:
+    enum class prim_type : unsigned char { sphere, quad, triangle, medium, instance };
+
+    struct flat_sphere {
+        point3 center;
+        vec3 center_vec;  // Motion per unit time, zero for stationary spheres
+        double radius;
+        int mat;
+        bool uv_needed;
+    };
+
+    struct flat_quad {
+        point3 Q;
+        vec3 u, v;
+        vec3 w;
+        vec3 normal;
+        real D;
+        real uv_scale;
+        int mat;
+    };
+
+    struct flat_triangle {
+        point3 Q;
+        vec3 u, v;
+        vec3 normal;
+        real uv_scale;
+        int mat;
+    };
+
+    struct flat_medium {
+        const hittable* boundary;
+        rigid_transform to_world;
+        bool identity;
+        double neg_inv_density;
+        int mat;
+    };
+
+    struct flat_instance {
+        const hittable* object;
+        rigid_transform to_world;
+        bool identity;
+    };
+
+    struct prim_ref {
+        prim_type type;
+        int index;  // Into the array for its type
+    };
+
+    struct bvh_entry {
+        prim_ref ref;
+        aabb bbox;
+    };
+
+    // BVH nodes are stored depth first: an interior node's left child follows it directly.
+    struct node {
+        aabb bbox;
+        int start = 0;  // First primitive reference of a leaf
+        int count = 0;  // Number of primitives in a leaf, zero for interior nodes
+        int right = 0;  // Index of the right child of an interior node
+        int axis = 0;   // Split axis of an interior node
+    };
+
+    std::vector<flat_sphere> spheres;
+    std::vector<flat_quad> quads;
+    std::vector<flat_triangle> triangles;
+    std::vector<flat_medium> media;
+    std::vector<flat_instance> instances;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<material_record> material_table;  // Records of materials, for tag dispatch
+    std::unordered_map<const material*, int> material_ids;
+
+    std::vector<bvh_entry> entries;  // Primitives collected before the BVH is built
+    std::vector<prim_ref> refs;      // Primitive references in BVH leaf order
+    std::vector<node> nodes;
+    int tree_depth = 0;
+
+    // Traversal keeps one node per level on a fixed stack. Deeper than balanced_depth,
+    // nodes split at the median, so a tree of any number of primitives an int can count
+    // stays within max_tree_depth levels.
+    static const int max_tree_depth = 64;
+    static const int balanced_depth = 32;
+
+    int material_id(const shared_ptr<material>& mat) {
+        auto found = material_ids.find(mat.get());
+        if (found != material_ids.end()) return found->second;
+
+        materials.push_back(mat);
+        material_table.push_back(mat->record());
+        material_ids[mat.get()] = int(materials.size()) - 1;
+        return int(materials.size()) - 1;
+    }
+
+    void set_material(hit_record& rec, int id) const {
+        rec.mat = materials[id];
+        rec.shading = &material_table[id];
+    }
+
+    void add_ref(prim_type type, size_t index, const aabb& bbox) {
+        entries.push_back({{type, int(index)}, bbox});
+    }
+
+    void build() {
+        if (entries.empty()) return;
+        nodes.reserve(2 * entries.size());
+        build_node(0, entries.size(), 0);
+
+        refs.reserve(entries.size());
+        for (const auto& entry : entries)
+            refs.push_back(entry.ref);
+        entries.clear();
+        entries.shrink_to_fit();
+    }
+
+    int build_node(size_t start, size_t end, int depth) {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+        tree_depth = std::max(tree_depth, depth);
+
+        aabb bbox = aabb::empty;
+        aabb centroids = aabb::empty;
+        for (size_t i = start; i < end; i++) {
+            bbox = aabb(bbox, entries[i].bbox);
+            centroids = aabb(centroids, aabb(centroid(entries[i].bbox), centroid(entries[i].bbox)));
+        }
+        nodes[index].bbox = bbox;
+
+        if (end - start <= 2) {
+            nodes[index].start = int(start);
+            nodes[index].count = int(end - start);
+            return index;
+        }
+
+        // Split along the axis where the centroids spread most, at the bin boundary with the
+        // lowest surface area cost. Coincident centroids, and nodes below balanced_depth,
+        // fall back to a median split.
+        int axis = centroids.longest_axis();
+        auto mid = depth < balanced_depth
+                 ? sah_split(start, end, axis, centroids.axis_interval(axis)) : start;
+        if (mid == start || mid == end) {
+            mid = start + (end - start)/2;
+            std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                [axis](const bvh_entry& a, const bvh_entry& b) {
+                    return centroid(a.bbox)[axis] < centroid(b.bbox)[axis];
+                });
+        }
+
+        nodes[index].axis = axis;
+        build_node(start, mid, depth + 1);
+        int right = build_node(mid, end, depth + 1);
+        nodes[index].right = right;
+        return index;
+    }
+
+    size_t sah_split(size_t start, size_t end, int axis, const interval& extent) {
+        // Returns the first entry of the right side after partitioning [start, end).
+        const int bin_count = 12;
+        if (extent.size() <= 0)
+            return start;
+
+        aabb bin_boxes[bin_count];
+        int bin_counts[bin_count] = {};
+        auto bin_of = [&](const bvh_entry& entry) {
+            int b = int(bin_count * (centroid(entry.bbox)[axis] - extent.min) / extent.size());
+            return b < bin_count ? b : bin_count - 1;
+        };
+
+        for (size_t i = start; i < end; i++) {
+            int b = bin_of(entries[i]);
+            bin_boxes[b] = aabb(bin_boxes[b], entries[i].bbox);
+            bin_counts[b]++;
+        }
+
+        // Sweep from the right to get the cost of each right side, then from the left.
+        double right_cost[bin_count];
+        aabb right_box;
+        int right_count = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            right_box = aabb(right_box, bin_boxes[b]);
+            right_count += bin_counts[b];
+            right_cost[b] = right_count * surface_area(right_box);
+        }
+
+        int best_split = 0;
+        double best_cost = infinity;
+        aabb left_box;
+        int left_count = 0;
+        for (int b = 1; b < bin_count; b++) {
+            left_box = aabb(left_box, bin_boxes[b-1]);
+            left_count += bin_counts[b-1];
+            auto cost = left_count * surface_area(left_box) + right_cost[b];
+            if (left_count > 0 && left_count < int(end - start) && cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+
+        if (best_split == 0)
+            return start;
+
+        auto middle = std::partition(entries.begin() + start, entries.begin() + end,
+            [&](const bvh_entry& entry) { return bin_of(entry) < best_split; });
+        return size_t(middle - entries.begin());
+    }
+
+    static double surface_area(const aabb& bbox) {
+        if (bbox.x.size() < 0) return 0;  // Empty box
+        double dx = bbox.x.size(), dy = bbox.y.size(), dz = bbox.z.size();
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    static point3 centroid(const aabb& bbox) {
+        return point3(bbox.x.min + bbox.x.max, bbox.y.min + bbox.y.max, bbox.z.min + bbox.z.max) / 2;
+    }
+
+    bool hit_primitive(int ref_index, const ray& r, interval ray_t, hit_record& rec) const {
+        const auto& ref = refs[ref_index];
+
+        switch (ref.type) {
+            case prim_type::sphere: {
+                const auto& s = spheres[ref.index];
+                double root0, root1;
+                if (!sphere_roots(s.center + r.time()*s.center_vec, s.radius, r, root0, root1))
+                    return false;
+
+                auto root = root0;
+                if (!ray_t.surrounds(root)) {
+                    root = root1;
+                    if (!ray_t.surrounds(root))
+                        return false;
+                }
+                rec.t = root;
+                break;
+            }
+            case prim_type::quad: {
+                const auto& q = quads[ref.index];
+                auto denom = dot(q.normal, r.direction());
+                if (std::fabs(denom) < 1e-8)
+                    return false;
+
+                auto t = (q.D - dot(q.normal, r.origin())) / denom;
+                if (!ray_t.contains(t))
+                    return false;
+
+                vec3 planar_hitpt_vector = r.at(t) - q.Q;
+                auto alpha = dot(q.w, cross(planar_hitpt_vector, q.v));
+                auto beta = dot(q.w, cross(q.u, planar_hitpt_vector));
+                if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1)
+                    return false;
+
+                rec.t = t;
+                rec.u = alpha;
+                rec.v = beta;
+                break;
+            }
+            case prim_type::triangle: {
+                const auto& tri = triangles[ref.index];
+                vec3 h = cross(r.direction(), tri.v);
+                auto a = dot(tri.u, h);
+                if (a > -1e-8 && a < 1e-8)
+                    return false;
+
+                auto f = 1 / a;
+                vec3 s = r.origin() - tri.Q;
+                auto u_bary = f * dot(s, h);
+                if (u_bary < 0.0 || u_bary > 1.0)
+                    return false;
+
+                vec3 q = cross(s, tri.u);
+                auto v_bary = f * dot(r.direction(), q);
+                if (v_bary < 0.0 || u_bary + v_bary > 1.0)
+                    return false;
+
+                auto t = f * dot(tri.v, q);
+                if (!ray_t.contains(t))
+                    return false;
+
+                rec.t = t;
+                rec.u = u_bary;
+                rec.v = v_bary;
+                break;
+            }
+            case prim_type::medium: {
+                if (!hit_medium(media[ref.index], r, ray_t, rec))
+                    return false;
+                break;
+            }
+            case prim_type::instance: {
+                const auto& inst = instances[ref.index];
+                if (inst.identity)
+                    return inst.object->hit(r, ray_t, rec);  // The object finishes its own surface
+
+                ray object_r = inst.to_world.inverse_ray(r);
+                if (!inst.object->hit(object_r, ray_t, rec))
+                    return false;
+
+                rec.object->compute_surface(object_r, rec);
+                rec.p = inst.to_world.point(rec.p);
+                rec.normal = inst.to_world.vector(rec.normal);
+                break;
+            }
+        }
+
+        rec.object = this;
+        rec.index = ref_index;
+        return true;
+    }
+
+    bool occludes(int ref_index, const ray& r, interval ray_t, sampler* samples) const {
+        const auto& ref = refs[ref_index];
+
+        if (ref.type == prim_type::instance) {
+            const auto& inst = instances[ref.index];
+            return inst.object->occluded(inst.identity ? r : inst.to_world.inverse_ray(r), ray_t,
+                                         samples);
+        }
+
+        if (ref.type == prim_type::sphere) {
+            const auto& s = spheres[ref.index];
+            double root0, root1;
+            if (!sphere_roots(s.center + r.time()*s.center_vec, s.radius, r, root0, root1))
+                return false;
+            return ray_t.surrounds(root0) || ray_t.surrounds(root1);
+        }
+
+        hit_record rec;
+        rec.samples = samples;
+        return hit_primitive(ref_index, r, ray_t, rec);
+    }
+
+    bool hit_medium(const flat_medium& medium, const ray& r, interval ray_t, hit_record& rec) const {
+        // The boundary is queried in its own space; rigid transforms leave the ray parameter
+        // t and the ray's length unchanged.
+        auto boundary_r = medium.identity ? r : medium.to_world.inverse_ray(r);
+        double t;
+        if (!constant_medium::free_flight(*medium.boundary, medium.neg_inv_density, boundary_r,
+                                          ray_t, rec.samples, t))
+            return false;
+
+        rec.t = t;
+        return true;
+    }
+};
+
+#endif
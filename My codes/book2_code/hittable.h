@@ -7,19 +7,34 @@
 
 #include "rtweekend.h"
 #include "aabb.h"
+#include "transform.h"
 
 class material; // Forward declaration
+struct material_record;
+class hittable;
+class sampler;
 
 // Stores information about a ray-object intersection.
+// hit() only fills in t, object (and any cheap per-primitive values it needs); the rest of
+// the surface is filled in by object->compute_surface() once the closest hit is known.
 class hit_record {
   public:
     point3 p;
     vec3 normal;
     shared_ptr<material> mat;
-    double t;
-    double u;
-    double v;
-    bool front_face;
+    const material_record* shading = nullptr;  // Flat record of mat, if the object keeps a table
+    real t = 0;
+    real u = 0;
+    real v = 0;
+    real uv_scale = 0;      // Change in (u,v) per unit distance along the surface, 0 if unknown
+    real uv_footprint = 0;  // Width in (u,v) of the ray's footprint, for texture filtering
+    bool front_face = false;
+    const hittable* object = nullptr;  // Primitive that produced this hit
+    int index = 0;                     // Which primitive, for objects that hold many
+    double sample[3] = {};  // Uniform numbers in [0,1) that scatter() picks its direction by,
+                            // drawn by the renderer's sampler (see sampler.h)
+    sampler* samples = nullptr;  // Set before hit(): the path's sampler, which media draw
+                                 // their scattering distances from; random_double() if null
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -27,6 +42,26 @@ class hit_record {
     }
 };
 
+// Receives the primitives of a scene graph as it is flattened into arrays (see flat_scene.h).
+// The add functions return false for primitives the compiled scene can't represent.
+class scene_compiler {
+  public:
+    virtual ~scene_compiler() = default;
+
+    // Flattens object, or keeps it as an opaque instance if it can't be flattened.
+    virtual void add_object(const hittable& object, const rigid_transform& to_world) = 0;
+
+    virtual bool add_sphere(const point3& center, const vec3& center_vec, double radius,
+                            const shared_ptr<material>& mat) = 0;
+    virtual bool add_quad(const point3& Q, const vec3& u, const vec3& v,
+                          const shared_ptr<material>& mat) = 0;
+    virtual bool add_triangle(const point3& Q, const vec3& u, const vec3& v,
+                              const shared_ptr<material>& mat) = 0;
+    virtual bool add_medium(const hittable& boundary, double neg_inv_density,
+                            const shared_ptr<material>& phase_function,
+                            const rigid_transform& to_world) = 0;
+};
+
 // Abstract class for objects that can be hit by a ray.
 class hittable {
   public:
@@ -34,6 +69,38 @@ class hittable {
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
     virtual aabb bounding_box() const = 0;
+
+    // Fills in the hit point, normal, material and texture coordinates of a hit found by
+    // hit(). Only called once per ray, for the closest hit.
+    virtual void compute_surface(const ray& r, hit_record& rec) const {}
+
+    // Returns true if the ray hits anything within ray_t. Unlike hit(), this can stop at the
+    // first intersection found, so it is the cheaper query for shadow and visibility rays.
+    // Media in the way draw from samples, as they would from hit_record::samples.
+    virtual bool occluded(const ray& r, interval ray_t, sampler* samples = nullptr) const {
+        hit_record rec;
+        rec.samples = samples;
+        return hit(r, ray_t, rec);
+    }
+
+    // Finds the first and last crossings of the ray with this object's surface within ray_t,
+    // returning them as span. For a closed convex boundary this is the entry and exit of the
+    // ray. The default makes two hit() queries; composites and spheres answer it in one pass.
+    virtual bool hit_span(const ray& r, interval ray_t, interval& span) const {
+        hit_record rec1, rec2;
+        if (!hit(r, ray_t, rec1))
+            return false;
+
+        auto last = hit(r, interval(rec1.t+0.0001, ray_t.max), rec2) ? rec2.t : rec1.t;
+        span = interval(rec1.t, last);
+        return true;
+    }
+
+    // Hands this object's primitives, moved into world space by to_world, to the compiler.
+    // Returns false if the object can't be flattened; it is then kept as an opaque instance.
+    virtual bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const {
+        return false;
+    }
 };
 
 class translate : public hittable {
@@ -52,12 +119,30 @@ class translate : public hittable {
         if (!object->hit(offset_r, ray_t, rec))
             return false;
 
+        // The surface must be evaluated with the offset ray, so finish it here.
+        rec.object->compute_surface(offset_r, rec);
+        rec.object = this;
+
         // Move the intersection point forwards by the offset
         rec.p += offset;
 
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t,
+                                samples);
+    }
+
+    bool hit_span(const ray& r, interval ray_t, interval& span) const override {
+        return object->hit_span(ray(r.origin() - offset, r.direction(), r.time()), ray_t, span);
+    }
+
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        compiler.add_object(*object, to_world * rigid_transform::translation(offset));
+        return true;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
   private:
@@ -104,25 +189,16 @@ class rotate_y : public hittable {
 
         // Transform the ray from world space to object space.
 
-        auto origin = point3(
-            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-            r.origin().y(),
-            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-        );
-
-        auto direction = vec3(
-            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-            r.direction().y(),
-            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-        );
-
-        ray rotated_r(origin, direction, r.time());
+        ray rotated_r = object_space_ray(r);
 
         // Determine whether an intersection exists in object space (and if so, where).
 
         if (!object->hit(rotated_r, ray_t, rec))
             return false;
 
+        rec.object->compute_surface(rotated_r, rec);
+        rec.object = this;
+
         // Transform the intersection from object space back to world space.
 
         rec.p = point3(
@@ -140,6 +216,19 @@ class rotate_y : public hittable {
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        return object->occluded(object_space_ray(r), ray_t, samples);
+    }
+
+    bool hit_span(const ray& r, interval ray_t, interval& span) const override {
+        return object->hit_span(object_space_ray(r), ray_t, span);
+    }
+
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        compiler.add_object(*object, to_world * rigid_transform::rotation_y(sin_theta, cos_theta));
+        return true;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
   private:
@@ -147,6 +236,22 @@ class rotate_y : public hittable {
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    ray object_space_ray(const ray& r) const {
+        auto origin = point3(
+            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+            r.origin().y(),
+            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
+        );
+
+        auto direction = vec3(
+            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+            r.direction().y(),
+            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
+        );
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 #endif
\ No newline at end of file
@@ -30,6 +30,7 @@ class hittable_list : public hittable {
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         hit_record temp_rec;
+        temp_rec.samples = rec.samples;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
 
@@ -44,6 +45,35 @@ class hittable_list : public hittable {
         return hit_anything;
     }
 
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        for (const auto& object : objects) {
+            if (object->occluded(r, ray_t, samples))
+                return true;
+        }
+        return false;
+    }
+
+    bool hit_span(const ray& r, interval ray_t, interval& span) const override {
+        interval object_span;
+        bool hit_anything = false;
+        span = interval::empty;
+
+        for (const auto& object : objects) {
+            if (object->hit_span(r, ray_t, object_span)) {
+                hit_anything = true;
+                span = interval(span, object_span);
+            }
+        }
+
+        return hit_anything;
+    }
+
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        for (const auto& object : objects)
+            compiler.add_object(*object, to_world);
+        return true;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
   private:
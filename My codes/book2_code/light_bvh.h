@@ -0,0 +1,353 @@
+// This file defines light_bvh, a bounding volume hierarchy over the lights of a scene that
+// picks a light in proportion to an estimate of its contribution at the point being shaded.
+// Each node bounds the positions, total power and surface normals of the lights below it,
+// which bounds how much light they can send toward a point. A pick walks down from the
+// root, choosing between two children by those bounds, so lights that are distant, dim or
+// turned edge-on are rarely picked, at a cost logarithmic in the number of lights
+// (after Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive Tree
+// Splitting").
+
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Bounds on a group of lights that emit diffusely from both sides of their surfaces.
+struct light_bounds {
+    aabb bounds;              // Points the lights emit from
+    double power = 0;         // Total emitted power, up to a common factor
+    vec3 axis = vec3(0,0,1);  // Axis of a cone holding the lines of the surface normals
+    double cos_spread = 1;    // Cosine of the cone's half angle; -1 for every direction
+
+    // An estimate of the light these lights send to p: their power over the squared
+    // distance, times the largest cosine between any of their normals and any direction
+    // from their bounds toward p. Zero if no light can reach p.
+    double importance(const point3& p) const {
+        if (power <= 0) return 0;
+
+        auto center = point3(bounds.x.min + bounds.x.max, bounds.y.min + bounds.y.max,
+                             bounds.z.min + bounds.z.max) / 2;
+        auto radius = diagonal() / 2;
+        vec3 to_p = p - center;
+        double distance_squared = to_p.length_squared();
+
+        // The angle between the cone and the direction toward p, less the cone's spread and
+        // less the spread of directions from points in the bounds toward p.
+        double cos_b = -1, sin_b = 0;
+        if (distance_squared > radius*radius) {
+            auto sin_squared = radius*radius / distance_squared;
+            sin_b = std::sqrt(sin_squared);
+            cos_b = std::sqrt(1 - sin_squared);
+        }
+
+        double cos_w = distance_squared > 0 ? std::fabs(dot(axis, to_p)) / std::sqrt(distance_squared) : 1;
+        auto sin_w = std::sqrt(std::max(0.0, 1 - cos_w*cos_w));
+        auto sin_o = std::sqrt(std::max(0.0, 1 - cos_spread*cos_spread));
+
+        double cos_x = 1, sin_x = 0;  // Angle less the cone's spread, clamped at zero
+        if (cos_w < cos_spread) {
+            cos_x = cos_w*cos_spread + sin_w*sin_o;
+            sin_x = sin_w*cos_spread - cos_w*sin_o;
+        }
+        auto cos_p = cos_x < cos_b ? cos_x*cos_b + sin_x*sin_b : 1;
+        if (cos_p <= 0) return 0;  // Every normal is at least a right angle away
+
+        // Keep points inside the bounds from getting an unbounded estimate.
+        distance_squared = std::max(distance_squared, radius);
+        return power * cos_p / distance_squared;
+    }
+
+    double diagonal() const {
+        return vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length();
+    }
+
+    // Bounds on the lights of both a and b.
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        light_bounds m;
+        m.bounds = aabb(a.bounds, b.bounds);
+        m.power = a.power + b.power;
+        if (a.power <= 0 || b.power <= 0) {
+            const auto& lit = a.power > 0 ? a : b;
+            m.axis = lit.axis;
+            m.cos_spread = lit.cos_spread;
+            return m;
+        }
+
+        // Both sides emit, so b's cone can be turned around to the side nearer a's axis.
+        auto b_axis = dot(a.axis, b.axis) < 0 ? -b.axis : b.axis;
+        auto theta_a = std::acos(std::clamp(a.cos_spread, -1.0, 1.0));
+        auto theta_b = std::acos(std::clamp(b.cos_spread, -1.0, 1.0));
+        auto theta_d = std::acos(std::clamp(double(dot(a.axis, b_axis)), -1.0, 1.0));
+
+        // One cone may hold the other.
+        if (std::min(theta_d + theta_b, pi) <= theta_a) {
+            m.axis = a.axis;
+            m.cos_spread = a.cos_spread;
+            return m;
+        }
+        if (std::min(theta_d + theta_a, pi) <= theta_b) {
+            m.axis = b_axis;
+            m.cos_spread = b.cos_spread;
+            return m;
+        }
+
+        // Otherwise the merged cone spans from the far side of one to the far side of the
+        // other, its axis turned from a's toward b's.
+        auto theta_o = (theta_a + theta_d + theta_b) / 2;
+        auto turn_axis = cross(a.axis, b_axis);
+        if (theta_o >= pi || turn_axis.length_squared() == 0) {
+            m.cos_spread = -1;
+            return m;
+        }
+
+        auto k = unit_vector(turn_axis);
+        auto turn = theta_o - theta_a;
+        m.axis = a.axis*std::cos(turn) + cross(k, a.axis)*std::sin(turn)
+               + k*dot(k, a.axis)*(1 - std::cos(turn));
+        m.cos_spread = std::cos(theta_o);
+        return m;
+    }
+};
+
+class light_bvh {
+  public:
+    light_bvh() {}
+
+    // Builds the hierarchy over lights, one per leaf. Lights keep their index in lights.
+    explicit light_bvh(const std::vector<light_bounds>& lights) : trails(lights.size()) {
+        if (lights.empty()) return;
+
+        std::vector<int> order(lights.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = int(i);
+        build(lights, order, 0, order.size(), 0, 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Picks a light for the point p by u in [0,1), setting pmf to the probability of the
+    // pick. Returns -1 if no light can reach p.
+    int sample(const point3& p, double u, double& pmf) const {
+        if (nodes.empty()) return -1;
+
+        pmf = 1;
+        int node_index = 0;
+        while (nodes[node_index].light < 0) {
+            const auto& node = nodes[node_index];
+            auto first = nodes[node_index + 1].bounds.importance(p);
+            auto second = nodes[node.right].bounds.importance(p);
+            if (first <= 0 && second <= 0) return -1;
+
+            // Reuse what is left of u for the choices further down.
+            auto p_first = first / (first + second);
+            if (u < p_first) {
+                node_index = node_index + 1;
+                u = std::min(u / p_first, 1 - 0x1p-53);
+                pmf *= p_first;
+            } else {
+                node_index = node.right;
+                u = std::min((u - p_first) / (1 - p_first), 1 - 0x1p-53);
+                pmf *= 1 - p_first;
+            }
+        }
+
+        if (node_index == 0 && nodes[0].bounds.importance(p) <= 0) return -1;
+        return nodes[node_index].light;
+    }
+
+    // The probability with which sample() picks the given light for the point p.
+    double pmf(const point3& p, int light) const {
+        if (nodes.empty()) return 0;
+        if (nodes[0].light >= 0) return nodes[0].bounds.importance(p) > 0 ? 1 : 0;
+
+        // The light's trail holds the child taken at each level on the way down to it.
+        double pmf = 1;
+        auto trail = trails[light];
+        int node_index = 0;
+        while (nodes[node_index].light < 0) {
+            const auto& node = nodes[node_index];
+            auto first = nodes[node_index + 1].bounds.importance(p);
+            auto second = nodes[node.right].bounds.importance(p);
+            if (first <= 0 && second <= 0) return 0;
+
+            bool take_second = trail & 1;
+            pmf *= (take_second ? second : first) / (first + second);
+            node_index = take_second ? node.right : node_index + 1;
+            trail >>= 1;
+        }
+        return pmf;
+    }
+
+    // Returns the first light whose bounds hold p, give or take rounding, and for which
+    // is_on(light) is true, or -1.
+    template <typename Predicate>
+    int find(const point3& p, const Predicate& is_on) const {
+        int stack[64];
+        int stack_size = 0;
+        int node_index = 0;
+
+        while (!nodes.empty()) {
+            const auto& node = nodes[node_index];
+            if (near(node.bounds, p)) {
+                if (node.light >= 0) {
+                    if (is_on(node.light)) return node.light;
+                } else {
+                    stack[stack_size++] = node.right;
+                    node_index = node_index + 1;
+                    continue;
+                }
+            }
+
+            if (stack_size == 0) break;
+            node_index = stack[--stack_size];
+        }
+        return -1;
+    }
+
+  private:
+    // Deeper than this, nodes split their lights evenly, so trails fit in 64 bits.
+    static const int balanced_depth = 40;
+
+    struct node {
+        light_bounds bounds;
+        int right = 0;   // Second child; the first follows the node
+        int light = -1;  // Light of a leaf, or -1 for inner nodes
+    };
+
+    std::vector<node> nodes;
+    std::vector<uint64_t> trails;  // Per light, bit d set if its path takes the second child at depth d
+
+    static bool near(const light_bounds& b, const point3& p) {
+        auto margin = 1e-3 * b.diagonal() + 1e-4;
+        return b.bounds.x.expand(margin).contains(p.x()) && b.bounds.y.expand(margin).contains(p.y())
+            && b.bounds.z.expand(margin).contains(p.z());
+    }
+
+    static point3 centroid(const light_bounds& b) {
+        return point3(b.bounds.x.min + b.bounds.x.max, b.bounds.y.min + b.bounds.y.max,
+                      b.bounds.z.min + b.bounds.z.max) / 2;
+    }
+
+    // Cost of a node with bounds b under a split along axis: its power, times a measure of
+    // the directions it emits in, times its surface area, times how elongated it is across
+    // the axis. Low-cost children are small, dim, or aligned.
+    static double cost(const light_bounds& b, const aabb& node_bounds, int axis) {
+        auto theta_o = std::acos(std::clamp(b.cos_spread, -1.0, 1.0));
+        auto theta_w = std::min(theta_o + pi/2, pi);
+        auto sin_o = std::sin(theta_o);
+        auto m_omega = 2*pi*(1 - b.cos_spread)
+                     + pi/2 * (2*theta_w*sin_o - std::cos(theta_o - 2*theta_w)
+                               - 2*theta_o*sin_o + b.cos_spread);
+
+        double sizes[3] = {node_bounds.x.size(), node_bounds.y.size(), node_bounds.z.size()};
+        auto elongation = std::max({sizes[0], sizes[1], sizes[2]}) / std::max(sizes[axis], 1e-8);
+
+        const auto& box = b.bounds;
+        auto area = 2 * (box.x.size()*box.y.size() + box.y.size()*box.z.size()
+                         + box.z.size()*box.x.size());
+        return b.power * m_omega * area * elongation;
+    }
+
+    int build(const std::vector<light_bounds>& lights, std::vector<int>& order, size_t start,
+              size_t end, int depth, uint64_t trail) {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+
+        if (end - start == 1) {
+            nodes[index].bounds = lights[order[start]];
+            nodes[index].light = order[start];
+            trails[order[start]] = trail;
+            return index;
+        }
+
+        light_bounds all = lights[order[start]];
+        aabb centroids(centroid(all), centroid(all));
+        for (size_t i = start + 1; i < end; i++) {
+            all = light_bounds::merge(all, lights[order[i]]);
+            auto c = centroid(lights[order[i]]);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        auto mid = split(lights, order, start, end, all.bounds, centroids, depth);
+
+        nodes[index].bounds = all;
+        build(lights, order, start, mid, depth + 1, trail);
+        nodes[index].right = build(lights, order, mid, end, depth + 1, trail | (uint64_t(1) << depth));
+        return index;
+    }
+
+    // Partitions order[start, end) by the cheapest of twelve bucket boundaries along each
+    // axis, or in half by count if no boundary separates the lights. Returns the split.
+    size_t split(const std::vector<light_bounds>& lights, std::vector<int>& order, size_t start,
+                 size_t end, const aabb& node_bounds, const aabb& centroids, int depth) {
+        const int bucket_count = 12;
+        auto best_cost = infinity;
+        int best_axis = -1, best_bucket = 0;
+
+        auto bucket_of = [&](int light, int axis) {
+            const auto& range = centroids.axis_interval(axis);
+            auto b = int(bucket_count * (centroid(lights[light])[axis] - range.min) / range.size());
+            return std::clamp(b, 0, bucket_count - 1);
+        };
+
+        for (int axis = 0; axis < 3 && depth < balanced_depth; axis++) {
+            if (centroids.axis_interval(axis).size() <= 1e-4) continue;  // aabb pads to 1e-4
+
+            light_bounds buckets[bucket_count];
+            bool filled[bucket_count] = {};
+            for (size_t i = start; i < end; i++) {
+                int b = bucket_of(order[i], axis);
+                buckets[b] = filled[b] ? light_bounds::merge(buckets[b], lights[order[i]])
+                                       : lights[order[i]];
+                filled[b] = true;
+            }
+
+            // Cost of the buckets above each boundary, then sweep up from below.
+            double above_cost[bucket_count] = {};
+            light_bounds above;
+            bool above_filled = false;
+            for (int b = bucket_count - 1; b > 0; b--) {
+                if (filled[b]) {
+                    above = above_filled ? light_bounds::merge(above, buckets[b]) : buckets[b];
+                    above_filled = true;
+                }
+                above_cost[b] = above_filled ? cost(above, node_bounds, axis) : -1;
+            }
+
+            light_bounds below;
+            bool below_filled = false;
+            for (int b = 0; b < bucket_count - 1; b++) {
+                if (filled[b]) {
+                    below = below_filled ? light_bounds::merge(below, buckets[b]) : buckets[b];
+                    below_filled = true;
+                }
+                if (!below_filled || above_cost[b + 1] < 0) continue;
+
+                auto split_cost = cost(below, node_bounds, axis) + above_cost[b + 1];
+                if (split_cost < best_cost) {
+                    best_cost = split_cost;
+                    best_axis = axis;
+                    best_bucket = b;
+                }
+            }
+        }
+
+        if (best_axis >= 0) {
+            auto mid = std::partition(order.begin() + start, order.begin() + end,
+                                      [&](int light) { return bucket_of(light, best_axis) <= best_bucket; });
+            return size_t(mid - order.begin());
+        }
+
+        auto axis = centroids.longest_axis();
+        auto mid = start + (end - start) / 2;
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                         [&](int a, int b) { return centroid(lights[a])[axis] < centroid(lights[b])[axis]; });
+        return mid;
+    }
+};
+
+#endif
@@ -0,0 +1,470 @@
+// This file defines light_list, the emissive primitives of a scene gathered for direct
+// light sampling. The scene graph is walked through the same flatten() hooks flat_scene
+// uses, so every diffuse_light sphere, quad and triangle is registered in world space. The
+// renderer samples a point on a light from each hit that scatters into a spread of
+// directions and traces a shadow ray to it, instead of waiting for a random bounce to find
+// the light; pdf() gives the density of such samples for weighting them against bounces.
+// Which light a sample goes to is picked uniformly, in proportion to the lights' power
+// through an alias table, or by their estimated contribution at the shaded point through a
+// light BVH (see light_bvh.h), which suits scenes of many lights. emit() traces light the
+// other way, out from the lights, for photon maps (see photon_map.h).
+
+#ifndef LIGHT_LIST_H
+#define LIGHT_LIST_H
+
+#include "alias_table.h"
+#include "hittable.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+// How light_list picks the light of a sample.
+enum class light_selection {
+    uniform,   // Every light equally likely
+    power,     // In proportion to emitted power
+    bvh,       // By estimated contribution at the shaded point
+    automatic  // power for a few lights, bvh for many
+};
+
+inline const char* light_selection_name(light_selection selection) {
+    switch (selection) {
+        case light_selection::uniform:   return "uniform";
+        case light_selection::power:     return "power";
+        case light_selection::bvh:       return "bvh";
+        default:                         return "automatic";
+    }
+}
+
+// A direction toward a point on a light, from the point being shaded.
+struct light_sample {
+    vec3 direction;  // Unit vector toward the light point
+    double distance;  // Distance to the light point
+    double pdf;       // Density of direction over solid angle, including the pick of the light
+    color radiance;   // Light emitted from the light point back along direction
+    const material* source;  // Material of the light
+};
+
+// A ray leaving a light, as emit() picks it.
+struct light_emission {
+    ray r;
+    vec3 normal;           // Unit normal of the light at r's origin, on the side r leaves
+    color radiance;        // Light emitted along r
+    double pdf_point;      // Density of r's origin per unit area, including the pick of the light
+    double pdf_direction;  // Density of r's direction per unit solid angle
+    const material* source;  // Material of the light
+
+    // The light carried along r over the density of picking it.
+    color flux() const {
+        auto cosine = dot(normal, unit_vector(r.direction()));
+        return radiance * (cosine / (pdf_point * pdf_direction));
+    }
+};
+
+class light_list : public scene_compiler {
+  public:
+    // Registers the lights of the scene graph rooted at world. Lights inside objects that
+    // can't be flattened (see hittable::flatten) are not registered.
+    explicit light_list(const hittable& world,
+                        light_selection selection = light_selection::automatic)
+      : selection(selection)
+    {
+        add_object(world, rigid_transform());
+        if (this->selection == light_selection::automatic)
+            this->selection = lights.size() <= few_lights ? light_selection::power : light_selection::bvh;
+
+        // The BVH also finds the light under a hit point for pdf(), whatever the selection.
+        std::vector<light_bounds> bounds;
+        std::vector<double> powers;
+        for (const auto& l : lights) {
+            bounds.push_back(bound(l));
+            powers.push_back(bounds.back().power);
+        }
+        tree = light_bvh(bounds);
+        by_power = alias_table(powers);
+    }
+
+    bool empty() const { return lights.empty(); }
+    int size() const { return int(lights.size()); }
+    light_selection selection_used() const { return selection; }
+
+    // Whether surfaces of mat are registered lights, whose emission sample() accounts for.
+    bool emits(const material* mat) const { return materials.count(mat) > 0; }
+
+    // Picks a light by pick and a point on it by point (uniform numbers in [0,1)), as seen
+    // from origin at the given time. Returns false if the point can't send light toward
+    // origin.
+    bool sample(const point3& origin, double time, double pick, const sample_2d& point,
+                light_sample& s) const {
+        if (lights.empty()) return false;
+
+        double pmf;
+        int index = pick_light(origin, pick, pmf);
+        if (index < 0) return false;
+
+        const auto& l = lights[index];
+        hit_record rec;
+        if (!sample_point(l, origin, time, point, s, rec))
+            return false;
+
+        s.pdf *= pmf;
+        s.radiance = shade_albedo(l.mat->record(), rec);
+        s.source = l.mat.get();
+        return true;
+    }
+
+    // The density, over solid angle, with which sample() picks the point rec where r hit a
+    // surface of mat, seen from r's origin. Zero if the point isn't on a registered light.
+    double pdf(const ray& r, const hit_record& rec, const material* mat) const {
+        int index = tree.find(rec.p, [&](int i) {
+            return lights[i].mat.get() == mat && on_light(lights[i], rec.p, r.time());
+        });
+        if (index < 0) return 0;
+
+        auto pmf = light_pmf(r.origin(), index);
+        return pmf > 0 ? point_pdf(lights[index], r.origin(), r.time(), rec.p) * pmf : 0;
+    }
+
+    // Picks a light in proportion to its power by pick, a point on it by point and a
+    // direction it emits into by direction, and starts e.r there at the given time. The mean
+    // of e.flux() over many emissions is the total power of the lights.
+    bool emit(double pick, const sample_2d& point, const sample_2d& direction, double time,
+              light_emission& e) const {
+        if (lights.empty()) return false;
+
+        double side;
+        int index = by_power.sample(pick, &side);
+        auto pmf = by_power.pmf(index);
+        if (pmf <= 0) return false;
+
+        const auto& l = lights[index];
+        hit_record rec;
+        surface_point(l, time, point, rec);
+
+        // Quads and triangles emit from both sides, picked by what's left of pick.
+        int sides = 1;
+        if (l.type != light_type::sphere) {
+            sides = 2;
+            if (side < 0.5) rec.normal = -rec.normal;
+        }
+
+        // Cosine-weighted about the normal.
+        auto d = rec.normal + sample_unit_vector(direction.u, direction.v);
+        if (d.near_zero()) d = rec.normal;
+        e.r = ray(rec.p, unit_vector(d), time);
+        e.normal = rec.normal;
+        e.radiance = shade_albedo(l.mat->record(), rec);
+        e.pdf_point = pmf / area(l);
+        e.pdf_direction = dot(rec.normal, e.r.direction()) / (sides * pi);
+        e.source = l.mat.get();
+        return e.pdf_direction > 0;
+    }
+
+    // The densities with which emit() picks the origin of r, a point on a surface of mat,
+    // and r's direction; normal is set to the light's normal there, on the side r leaves.
+    // Returns false if the point isn't on a registered light.
+    bool emit_pdf(const ray& r, const material* mat, double& pdf_point, double& pdf_direction,
+                  vec3& normal) const {
+        auto p = r.origin();
+        int index = tree.find(p, [&](int i) {
+            return lights[i].mat.get() == mat && on_light(lights[i], p, r.time());
+        });
+        if (index < 0) return false;
+
+        const auto& l = lights[index];
+        int sides = 1;
+        if (l.type == light_type::sphere) {
+            normal = unit_vector(p - (l.Q + r.time()*l.u));
+        } else {
+            sides = 2;
+            normal = unit_vector(cross(l.u, l.v));
+            if (dot(normal, r.direction()) < 0) normal = -normal;
+        }
+        pdf_point = by_power.pmf(index) / area(l);
+        pdf_direction = std::max(0.0, double(dot(normal, unit_vector(r.direction())))) / (sides * pi);
+        return true;
+    }
+
+    // Scene compiler interface, called while walking the scene graph.
+
+    void add_object(const hittable& object, const rigid_transform& to_world) override {
+        object.flatten(*this, to_world);
+    }
+
+    bool add_sphere(const point3& center, const vec3& center_vec, double radius,
+                    const shared_ptr<material>& mat) override {
+        if (is_light(mat))
+            add_light({light_type::sphere, center, center_vec, vec3(), radius, mat});
+        return true;
+    }
+
+    bool add_quad(const point3& Q, const vec3& u, const vec3& v,
+                  const shared_ptr<material>& mat) override {
+        if (is_light(mat))
+            add_light({light_type::quad, Q, u, v, 0, mat});
+        return true;
+    }
+
+    bool add_triangle(const point3& Q, const vec3& u, const vec3& v,
+                      const shared_ptr<material>& mat) override {
+        if (is_light(mat))
+            add_light({light_type::triangle, Q, u, v, 0, mat});
+        return true;
+    }
+
+    bool add_medium(const hittable& boundary, double neg_inv_density,
+                    const shared_ptr<material>& phase_function,
+                    const rigid_transform& to_world) override {
+        return true;  // Media don't emit
+    }
+
+  private:
+    enum class light_type : unsigned char { sphere, quad, triangle };
+
+    struct light {
+        light_type type;
+        point3 Q;   // Sphere center, or corner of a quad or triangle
+        vec3 u, v;  // Edges of a quad or triangle; u is a sphere's motion per unit time
+        double radius;
+        shared_ptr<material> mat;
+    };
+
+    // Up to this many lights, automatic selection picks by power; a BVH walk costs more than
+    // it saves.
+    static const size_t few_lights = 16;
+
+    std::vector<light> lights;
+    std::unordered_set<const material*> materials;  // Materials of the registered lights
+    light_selection selection;
+    alias_table by_power;  // For selection by power, and emission
+    light_bvh tree;        // For selection by contribution, and finding lights by point
+
+    // Picks a light for a sample from origin by u, setting pmf to the probability of the
+    // pick. Returns -1 if there is no light to pick.
+    int pick_light(const point3& origin, double u, double& pmf) const {
+        switch (selection) {
+            case light_selection::power: {
+                int index = by_power.sample(u);
+                pmf = by_power.pmf(index);
+                return pmf > 0 ? index : -1;
+            }
+            case light_selection::bvh:
+                return tree.sample(origin, u, pmf);
+            default:
+                pmf = 1.0 / lights.size();
+                return std::min(int(u * lights.size()), int(lights.size()) - 1);
+        }
+    }
+
+    // The probability with which pick_light() picks the light of the given index.
+    double light_pmf(const point3& origin, int index) const {
+        switch (selection) {
+            case light_selection::power: return by_power.pmf(index);
+            case light_selection::bvh:   return tree.pmf(origin, index);
+            default:                     return 1.0 / lights.size();
+        }
+    }
+
+    // Bounds on where l emits from and in which directions, and its power: its mean
+    // emitted radiance times its area (the factor pi of diffuse emission is left out).
+    static light_bounds bound(const light& l) {
+        light_bounds b;
+        b.power = mean_emission(l) * area(l);
+        if (l.type == light_type::sphere) {
+            auto r = vec3(l.radius, l.radius, l.radius);
+            b.bounds = aabb(aabb(l.Q - r, l.Q + r), aabb(l.Q + l.u - r, l.Q + l.u + r));
+            b.cos_spread = -1;  // Normals point every way
+        } else {
+            auto far = l.type == light_type::triangle ? l.Q + l.v : l.Q + l.u + l.v;
+            b.bounds = aabb(aabb(l.Q, l.Q + l.u), aabb(l.Q + l.v, far));
+            b.axis = unit_vector(cross(l.u, l.v));
+            b.cos_spread = 1;  // One normal
+        }
+        return b;
+    }
+
+    // The mean over l's surface of its emitted radiance, averaged over color channels.
+    // Textured emission is averaged over a grid of points.
+    static double mean_emission(const light& l) {
+        const auto& m = l.mat->record();
+        auto channel_mean = [](const color& c) { return (c.x() + c.y() + c.z()) / 3; };
+        if (m.constant_albedo) return channel_mean(m.albedo);
+
+        const int n = 4;
+        double sum = 0;
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                hit_record rec;
+                sample_2d point{(i + 0.5) / n, (j + 0.5) / n};
+                if (l.type == light_type::sphere) {
+                    rec.normal = sample_unit_vector(point.u, point.v);
+                    rec.p = l.Q + l.radius * rec.normal;
+                    sphere::get_sphere_uv(rec.normal, rec.u, rec.v);
+                } else {
+                    auto a = point.u, b = point.v;
+                    if (l.type == light_type::triangle && a + b > 1) {
+                        a = 1 - a;
+                        b = 1 - b;
+                    }
+                    rec.p = l.Q + a*l.u + b*l.v;
+                    rec.u = real(a);
+                    rec.v = real(b);
+                }
+                sum += channel_mean(shade_albedo(m, rec));
+            }
+        }
+        return std::max(0.0, sum / (n*n));
+    }
+
+    static bool is_light(const shared_ptr<material>& mat) {
+        return mat && mat->record().kind == material_kind::diffuse_light;
+    }
+
+    void add_light(const light& l) {
+        lights.push_back(l);
+        materials.insert(l.mat.get());
+    }
+
+    // Samples a point of l, filling in the direction, distance and pdf of s and the point,
+    // normal and texture coordinates of rec.
+    static bool sample_point(const light& l, const point3& origin, double time,
+                             const sample_2d& point, light_sample& s, hit_record& rec) {
+        if (l.type == light_type::sphere)
+            return sample_sphere(l, origin, time, point, s, rec);
+
+        // Quads and triangles: a uniform point on the shape, with its area density converted
+        // to solid angle.
+        surface_point(l, time, point, rec);
+        return to_point(origin, rec, area(l), s);
+    }
+
+    // Fills in the point, normal and texture coordinates of rec for a point picked
+    // uniformly over the area of l by point.
+    static void surface_point(const light& l, double time, const sample_2d& point,
+                              hit_record& rec) {
+        if (l.type == light_type::sphere) {
+            rec.normal = sample_unit_vector(point.u, point.v);
+            rec.p = l.Q + time*l.u + l.radius * rec.normal;
+            sphere::get_sphere_uv(rec.normal, rec.u, rec.v);
+            return;
+        }
+
+        auto a = point.u, b = point.v;
+        if (l.type == light_type::triangle) {
+            auto root = std::sqrt(a);
+            a = root * (1 - b);
+            b = root * b;
+        }
+
+        rec.p = l.Q + a*l.u + b*l.v;
+        rec.u = real(a);
+        rec.v = real(b);
+        rec.normal = unit_vector(cross(l.u, l.v));
+    }
+
+    static double area(const light& l) {
+        if (l.type == light_type::sphere) return 4*pi * l.radius*l.radius;
+        auto parallelogram = cross(l.u, l.v).length();
+        return l.type == light_type::triangle ? parallelogram / 2 : parallelogram;
+    }
+
+    // Whether p lies on the surface of l, up to the precision of hit points.
+    static bool on_light(const light& l, const point3& p, double time) {
+        if (l.type == light_type::sphere)
+            return std::fabs((p - (l.Q + time*l.u)).length() - l.radius) <= 1e-3 * l.radius;
+
+        auto n = cross(l.u, l.v);
+        auto offset = p - l.Q;
+        if (std::fabs(dot(n, offset)) > 1e-3 * n.length() * std::sqrt(n.length()))
+            return false;
+
+        // Plane coordinates of p, as quad::hit() computes them.
+        auto w = n / dot(n, n);
+        auto a = dot(w, cross(offset, l.v));
+        auto b = dot(w, cross(l.u, offset));
+        const double e = 1e-6;
+        if (l.type == light_type::triangle)
+            return a >= -e && b >= -e && a + b <= 1 + e;
+        return a >= -e && a <= 1 + e && b >= -e && b <= 1 + e;
+    }
+
+    // The density of sample_point() picking the direction toward p, a point on l.
+    static double point_pdf(const light& l, const point3& origin, double time, const point3& p) {
+        vec3 normal;
+        if (l.type == light_type::sphere) {
+            auto center = l.Q + time*l.u;
+            auto distance_squared = (center - origin).length_squared();
+            auto radius_squared = l.radius * l.radius;
+            if (distance_squared > radius_squared) {
+                auto cos_theta_max = std::sqrt(1 - radius_squared / distance_squared);
+                return 1 / (2*pi*(1 - cos_theta_max));
+            }
+            normal = (p - center) / l.radius;
+        } else {
+            normal = unit_vector(cross(l.u, l.v));
+        }
+
+        vec3 to_light = p - origin;
+        auto cosine = std::fabs(dot(normal, unit_vector(to_light)));
+        if (cosine < 1e-8) return 0;
+        return to_light.length_squared() / (cosine * area(l));
+    }
+
+    static bool sample_sphere(const light& l, const point3& origin, double time,
+                              const sample_2d& point, light_sample& s, hit_record& rec) {
+        auto center = l.Q + time*l.u;
+        vec3 to_center = center - origin;
+        auto distance_squared = to_center.length_squared();
+        auto radius_squared = l.radius * l.radius;
+
+        if (distance_squared <= radius_squared) {
+            // From inside, every point of the sphere is visible: sample its area uniformly.
+            surface_point(l, time, point, rec);
+            return to_point(origin, rec, 4*pi*radius_squared, s);
+        }
+
+        // From outside, sample the cone of directions the sphere subtends uniformly.
+        auto cos_theta_max = std::sqrt(1 - radius_squared / distance_squared);
+        auto z = 1 + point.u * (cos_theta_max - 1);
+        auto phi = 2*pi*point.v;
+        auto r = std::sqrt(std::max(0.0, 1 - z*z));
+
+        auto w = unit_vector(to_center);
+        auto a = std::fabs(w.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0);
+        auto v = unit_vector(cross(w, a));
+        auto u = cross(w, v);
+        s.direction = r*std::cos(phi)*u + r*std::sin(phi)*v + z*w;
+
+        // The nearer crossing of the sphere along the direction.
+        auto half_b = dot(s.direction, to_center);
+        auto discriminant = std::max(0.0, double(half_b*half_b - (distance_squared - radius_squared)));
+        s.distance = half_b - std::sqrt(discriminant);
+        s.pdf = 1 / (2*pi*(1 - cos_theta_max));
+
+        rec.p = origin + s.distance * s.direction;
+        rec.normal = (rec.p - center) / l.radius;
+        sphere::get_sphere_uv(rec.normal, rec.u, rec.v);
+        return s.pdf > 0 && s.pdf < infinity;
+    }
+
+    // Fills in s for a point rec.p sampled uniformly over a light of the given area.
+    static bool to_point(const point3& origin, const hit_record& rec, double area,
+                         light_sample& s) {
+        vec3 to_light = rec.p - origin;
+        auto distance_squared = to_light.length_squared();
+        s.distance = std::sqrt(distance_squared);
+        s.direction = to_light / s.distance;
+
+        // Lights emit from both sides.
+        auto cosine = std::fabs(dot(rec.normal, s.direction));
+        if (cosine < 1e-8 || area <= 0) return false;
+
+        s.pdf = distance_squared / (cosine * area);
+        return true;
+    }
+};
+
+#endif
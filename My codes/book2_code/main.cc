@@ -4,9 +4,11 @@
 
 #include "rtweekend.h"
 
+#include "baked_texture.h"
 #include "camera.h"
 #include "hittable_list.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "material.h"
 #include "quad.h"
 #include "bvh.h"
@@ -15,8 +17,20 @@
 #include <vector>
 #include "constant_medium.h"
 
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+bool use_sphere_set() {
+    // Small spheres are batched into a sphere_set, unless RTW_SPHERE_SET=0 asks for one
+    // object per sphere (used by benchmark.py to compare the two).
+    auto setting = std::getenv("RTW_SPHERE_SET");
+    return !(setting && std::string(setting) == "0");
+}
+
 void bouncing_spheres() {
     hittable_list world;
+    auto small_spheres = make_shared<sphere_set>();
 
     auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
@@ -34,22 +48,36 @@ void bouncing_spheres() {
                     auto albedo = color::random() * color::random();
                     sphere_material = make_shared<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0,.5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                    if (use_sphere_set())
+                        small_spheres->add(center, center2, 0.2, sphere_material);
+                    else
+                        world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
                     sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    if (use_sphere_set())
+                        small_spheres->add(center, 0.2, sphere_material);
+                    else
+                        world.add(make_shared<sphere>(center, 0.2, sphere_material));
                 } else {
                     // glass
                     sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    if (use_sphere_set())
+                        small_spheres->add(center, 0.2, sphere_material);
+                    else
+                        world.add(make_shared<sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
+    if (use_sphere_set()) {
+        small_spheres->build();
+        world.add(small_spheres);
+    }
+
     auto material1 = make_shared<dielectric>(1.5);
     world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
 
@@ -135,7 +163,10 @@ void earth() {
 void perlin_spheres() {
     hittable_list world;
 
-    auto pertext = make_shared<noise_texture>(4);
+    // The marble of the small sphere can be baked (RTW_BAKE_RESOLUTION); the ground outside
+    // the grid still evaluates the noise.
+    auto pertext = baked_texture::bake_if_enabled(make_shared<noise_texture>(4),
+                                                  aabb(point3(-2,0,-2), point3(2,4,2)));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
     world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
 
@@ -247,7 +278,10 @@ void triangle_scene() {
 void simple_light() {
     hittable_list world;
 
-    auto pertext = make_shared<noise_texture>(4);
+    // The marble of the small sphere can be baked (RTW_BAKE_RESOLUTION); the ground outside
+    // the grid still evaluates the noise.
+    auto pertext = baked_texture::bake_if_enabled(make_shared<noise_texture>(4),
+                                                  aabb(point3(-2,0,-2), point3(2,4,2)));
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
     world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
 
@@ -408,15 +442,26 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     world.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
 
     hittable_list boxes2;
+    auto spheres2 = make_shared<sphere_set>();
     auto white = make_shared<lambertian>(color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
+        if (use_sphere_set())
+            spheres2->add(point3::random(0,165), 10, white);
+        else
+            boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
+    }
+
+    shared_ptr<hittable> cluster;
+    if (use_sphere_set()) {
+        spheres2->build();
+        cluster = spheres2;
+    } else {
+        cluster = make_shared<bvh_node>(boxes2);
     }
 
     world.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2), 15),
+        make_shared<rotate_y>(cluster, 15),
             vec3(-100,270,395)
         )
     );
@@ -439,8 +484,107 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     cam.render(world);
 }
 
-int main() {
-    switch (10) {
+void texture_formats() {
+    // Reports the memory and sampling throughput of earthmap.jpg in each storage format.
+    // Prints to std::clog; no image is rendered.
+    const int lookups = 2000000;
+
+    for (auto format : {texel_format::srgb8, texel_format::half, texel_format::bc1}) {
+        image_texture tex("earthmap.jpg", format);
+
+        auto start = std::chrono::steady_clock::now();
+        color sum(0,0,0);
+        for (int i = 0; i < lookups; i++)
+            sum += tex.filtered_value(random_double(), random_double(), point3(), 0.002);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+        std::clog << texel_format_name(format) << ": " << tex.size_in_bytes() / 1024 << " KiB, "
+                  << lookups / seconds.count() / 1e6 << " M trilinear lookups/s"
+                  << " (checksum " << sum.x() + sum.y() + sum.z() << ")\n";
+    }
+}
+
+void many_lights() {
+    // A 100x100 grid of small lights of mixed colors and strengths over a floor, for
+    // comparing how light samples pick among many lights (RTW_LIGHT_SELECTION).
+    hittable_list world;
+
+    world.add(make_shared<quad>(point3(-120,0,-120), vec3(240,0,0), vec3(0,0,240),
+                                make_shared<lambertian>(color(0.6, 0.6, 0.6))));
+    world.add(make_shared<sphere>(point3(-2,1.5,-60), 1.5, make_shared<lambertian>(color(0.7, 0.3, 0.1))));
+    world.add(make_shared<sphere>(point3(2.5,1.5,-58), 1.5, make_shared<metal>(color(0.8, 0.8, 0.9), 0.2)));
+    world.add(box(point3(-8,0,-50), point3(-5,4,-47), make_shared<lambertian>(color(0.2, 0.4, 0.7))));
+
+    // Lights share a few materials: four colors at four strengths, the strong ones rare.
+    std::vector<shared_ptr<material>> emitters;
+    for (auto tint : {color(1,1,1), color(1,0.6,0.3), color(0.3,0.5,1), color(0.4,1,0.5)})
+        for (auto strength : {2.0, 8.0, 32.0, 128.0})
+            emitters.push_back(make_shared<diffuse_light>(strength * tint));
+
+    hittable_list lights;
+    const int lights_per_side = 100;
+    for (int i = 0; i < lights_per_side; i++) {
+        for (int j = 0; j < lights_per_side; j++) {
+            auto strength = random_double() < 0.9 ? random_int(0, 1) : random_int(2, 3);
+            auto& mat = emitters[4 * random_int(0, 3) + strength];
+            auto corner = point3(-100 + 2*i, random_double(5, 7), -100 + 2*j);
+            lights.add(make_shared<quad>(corner, vec3(0.3,0,0), vec3(0,0,0.3), mat));
+        }
+    }
+    world.add(make_shared<bvh_node>(lights));
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 32;
+    cam.max_depth         = 8;
+    cam.background        = color(0,0,0);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(0, 3, -75);
+    cam.lookat   = point3(0, 1.5, -50);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+void environment_lit() {
+    // A few spheres on a floor under an HDR sky with a small, bright sun, for comparing
+    // sampled environment light (the default) with bounces alone (RTW_SAMPLE_LIGHTS=0).
+    hittable_list world;
+
+    world.add(make_shared<quad>(point3(-20,0,-20), vec3(40,0,0), vec3(0,0,40),
+                                make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+    world.add(make_shared<sphere>(point3(0,1,0), 1, make_shared<lambertian>(color(0.7, 0.2, 0.1))));
+    world.add(make_shared<sphere>(point3(-2.5,1,0.5), 1, make_shared<metal>(color(0.8, 0.8, 0.8), 0.1)));
+    world.add(make_shared<sphere>(point3(2.5,1,-0.5), 1, make_shared<dielectric>(1.5)));
+
+    camera cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 64;
+    cam.max_depth         = 20;
+    cam.environment_map   = make_shared<environment>("sky.hdr", 0.5);
+
+    cam.vfov     = 30;
+    cam.lookfrom = point3(6, 3, -10);
+    cam.lookat   = point3(0, 0.8, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+int main(int argc, char* argv[]) {
+    // The scene can be picked on the command line; the final scene is the default.
+    int scene = (argc > 1) ? std::atoi(argv[1]) : 10;
+
+    switch (scene) {
         case 1:  bouncing_spheres();   break;
         case 2:  checkered_spheres();  break;
         case 3:  earth();              break;
@@ -451,5 +595,8 @@ int main() {
         case 8:  cornell_box();        break;
         case 9:  cornell_smoke();      break;
         case 10:  final_scene(800, 5000, 40); break;
+        case 11:  texture_formats();   break;
+        case 12:  many_lights();       break;
+        case 13:  environment_lit();   break;
     }
 }
\ No newline at end of file
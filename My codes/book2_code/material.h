@@ -1,26 +1,58 @@
 // This file defines the abstract material base class, which provides the interface
 // for how rays interact with surfaces. It includes concrete implementations for
 // lambertian (diffuse), metal (reflective), and dielectric (refractive) materials.
+// Besides sampling a scattered ray, materials report the density of the directions they
+// sample and evaluate their scattering for a given direction, so the renderer can weigh
+// light samples against them (multiple importance sampling).
+// Each material also describes itself as a material_record, a flat tagged record that the
+// renderer shades with a switch instead of virtual calls (see shade_emitted/shade_scatter).
 
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
 #include "rtweekend.h"
+#include "sampler.h"
 #include "texture.h"
+#include "texture_program.h"
 
 class hit_record;
+class material;
+
+enum class material_kind : unsigned char {
+    lambertian, metal, dielectric, diffuse_light, isotropic,
+    other  // Any other material, shaded through its virtual functions
+};
+
+struct material_record {
+    material_kind kind = material_kind::other;
+    bool emissive = true;          // Whether emitted() can be nonzero
+    bool constant_albedo = false;  // Whether albedo holds the texture's value everywhere
+    color albedo;                  // Albedo, or emitted color for lights
+    double param = 0;              // Metal fuzz or dielectric index of refraction
+    const texture_program* program = nullptr;  // Compiled albedo or emission texture
+    const material* source = nullptr;  // The material this record describes
+};
 
 // Abstract base class for all materials.
 // The core function is scatter(), which determines how a ray behaves when it hits the material.
 class material {
   public:
+    material() { desc.source = this; }
+    material(const material&) = delete;
+    material& operator=(const material&) = delete;
+
     virtual ~material() = default;
 
     virtual color emitted(double u, double v, const point3& p) const {
         return color(0,0,0);
     }
 
+    // Whether shading this material reads the hit record's (u,v) texture coordinates.
+    virtual bool needs_uv() const { return false; }
+
     // Computes a scattered ray based on the hit record and material properties.
+    // Random choices are made from the numbers in rec.sample, so the renderer's sampler can
+    // spread them over the samples of a pixel.
     // r_in: The incoming ray.
     // rec: The hit_record of the intersection.
     // attenuation: The color attenuation of the material.
@@ -28,25 +60,86 @@ class material {
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const = 0;
+
+    // The density, over solid angle, with which scatter() picks direction. Zero for
+    // materials that scatter into single directions (mirrors, glass) or can't tell.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction)
+    const {
+        return 0;
+    }
+
+    // The light scattered back along r_in per unit of light arriving from direction: the
+    // BSDF times the cosine at surfaces. For directions scatter() picks, attenuation is
+    // eval() / scattering_pdf().
+    virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return color(0,0,0);
+    }
+
+    const material_record& record() const { return desc; }
+
+  protected:
+    material_record desc;
+    texture_program program;
+
+    // Fills in the record of a built-in material kind.
+    void describe(material_kind kind, bool emissive, const texture& tex, double param = 0) {
+        program = texture_program(tex);
+        desc.kind = kind;
+        desc.emissive = emissive;
+        desc.program = &program;
+        desc.param = param;
+        desc.constant_albedo = program.is_constant(desc.albedo);
+    }
+
+    void describe(material_kind kind, const color& albedo, double param) {
+        desc.kind = kind;
+        desc.emissive = false;
+        desc.albedo = albedo;
+        desc.constant_albedo = true;
+        desc.param = param;
+    }
 };
 
 // A diffuse (matte) material.
 class lambertian : public material {
   public:
-    lambertian(const color& a) : tex(make_shared<solid_color>(a)) {}
-    lambertian(shared_ptr<texture> t) : tex(t) {}
+    lambertian(const color& a) : lambertian(make_shared<solid_color>(a)) {}
+    lambertian(shared_ptr<texture> t) : tex(t) {
+        describe(material_kind::lambertian, false, *tex);
+    }
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        scattered = scatter_ray(r_in, rec);
+        attenuation = tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
+        return true;
+    }
+
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction)
+    const override {
+        return pdf(rec, direction);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return pdf(rec, direction) * tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
+    }
+
+    bool needs_uv() const override { return tex->needs_uv(); }
+
+    // Directions are cosine weighted about the normal: the density is cos(theta) / pi.
+    static double pdf(const hit_record& rec, const vec3& direction) {
+        auto cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0 ? cosine / pi : 0;
+    }
+
+    static ray scatter_ray(const ray& r_in, const hit_record& rec) {
+        auto scatter_direction = rec.normal + sample_unit_vector(rec.sample[0], rec.sample[1]);
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
-        return true;
+        return ray(rec.p, scatter_direction, r_in.time());
     }
 
   private:
@@ -56,16 +149,51 @@ class lambertian : public material {
 // A metallic material.
 class metal : public material {
   public:
-    metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {
+        describe(material_kind::metal, albedo, fuzz);
+    }
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
         attenuation = albedo;
+        return scatter_ray(r_in, rec, fuzz, scattered);
+    }
+
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction)
+    const override {
+        return pdf(r_in, rec, fuzz, direction);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        if (dot(direction, rec.normal) <= 0) return color(0,0,0);
+        return pdf(r_in, rec, fuzz, direction) * albedo;
+    }
+
+    static bool scatter_ray(const ray& r_in, const hit_record& rec, double fuzz, ray& scattered) {
+        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+        auto offset = sample_in_unit_sphere(rec.sample[0], rec.sample[1], rec.sample[2]);
+        scattered = ray(rec.p, reflected + fuzz*offset, r_in.time());
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    // scatter_ray() picks a point uniformly in the ball of radius fuzz around the unit mirror
+    // direction, so the density of a direction is the ball's volume along it, over the
+    // ball's volume: the integral of t^2 dt across the ball, times 3 / (4 pi fuzz^3).
+    // Directions below the surface are picked too, but absorbed. Zero for a perfect mirror.
+    static double pdf(const ray& r_in, const hit_record& rec, double fuzz, const vec3& direction) {
+        if (fuzz <= 0) return 0;
+
+        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+        auto b = dot(unit_vector(direction), reflected);
+        auto discriminant = b*b - (1 - fuzz*fuzz);
+        if (discriminant <= 0) return 0;
+
+        auto root = std::sqrt(discriminant);
+        auto t0 = std::fmax(0.0, b - root), t1 = b + root;
+        if (t1 <= t0) return 0;
+        return (t1*t1*t1 - t0*t0*t0) / (4*pi * fuzz*fuzz*fuzz);
+    }
+
   private:
     color albedo;
     double fuzz;
@@ -73,11 +201,18 @@ class metal : public material {
 
 class dielectric : public material {
   public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    dielectric(double index_of_refraction) : ir(index_of_refraction) {
+        describe(material_kind::dielectric, color(1.0, 1.0, 1.0), ir);
+    }
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
         attenuation = color(1.0, 1.0, 1.0);
+        scattered = scatter_ray(r_in, rec, ir);
+        return true;
+    }
+
+    static ray scatter_ray(const ray& r_in, const hit_record& rec, double ir) {
         double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
         vec3 unit_direction = unit_vector(r_in.direction());
@@ -87,13 +222,12 @@ class dielectric : public material {
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > rec.sample[2])
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-        scattered = ray(rec.p, direction, r_in.time());
-        return true;
+        return ray(rec.p, direction, r_in.time());
     }
 
   private:
@@ -109,8 +243,10 @@ class dielectric : public material {
 
 class diffuse_light : public material {
   public:
-    diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-    diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
+    diffuse_light(shared_ptr<texture> tex) : tex(tex) {
+        describe(material_kind::diffuse_light, true, *this->tex);
+    }
+    diffuse_light(const color& emit) : diffuse_light(make_shared<solid_color>(emit)) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
@@ -121,24 +257,133 @@ class diffuse_light : public material {
         return tex->value(u, v, p);
     }
 
+    bool needs_uv() const override { return tex->needs_uv(); }
+
   private:
     shared_ptr<texture> tex;
 };
 
 class isotropic : public material {
   public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    isotropic(shared_ptr<texture> tex) : tex(tex) {}
+    isotropic(const color& albedo) : isotropic(make_shared<solid_color>(albedo)) {}
+    isotropic(shared_ptr<texture> tex) : tex(tex) {
+        describe(material_kind::isotropic, false, *this->tex);
+    }
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        scattered = scatter_ray(r_in, rec);
+        attenuation = tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
         return true;
     }
 
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction)
+    const override {
+        return 1 / (4*pi);
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint) / (4*pi);
+    }
+
+    bool needs_uv() const override { return tex->needs_uv(); }
+
+    // Directions are uniform over the sphere.
+    static ray scatter_ray(const ray& r_in, const hit_record& rec) {
+        return ray(rec.p, sample_unit_vector(rec.sample[0], rec.sample[1]), r_in.time());
+    }
+
   private:
     shared_ptr<texture> tex;
 };
 
-#endif
\ No newline at end of file
+
+// Tag-dispatched shading of a material_record. These match the materials' emitted(),
+// scatter(), scattering_pdf() and eval(), but skip the emission of non-emissive materials
+// and the texture lookup of constant albedos, and evaluate other textures through their
+// compiled programs.
+
+// Returns the albedo (or emission) at the hit, filtered over the ray's footprint.
+inline color shade_albedo(const material_record& m, const hit_record& rec) {
+    return m.constant_albedo ? m.albedo : m.program->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+}
+
+inline color shade_emitted(const material_record& m, const hit_record& rec) {
+    if (!m.emissive)
+        return color(0,0,0);
+
+    if (m.kind == material_kind::diffuse_light)
+        return shade_albedo(m, rec);
+
+    return m.source->emitted(rec.u, rec.v, rec.p);
+}
+
+inline bool shade_scatter(
+    const material_record& m, const ray& r_in, const hit_record& rec, color& attenuation,
+    ray& scattered
+) {
+    switch (m.kind) {
+        case material_kind::lambertian:
+            scattered = lambertian::scatter_ray(r_in, rec);
+            attenuation = shade_albedo(m, rec);
+            return true;
+
+        case material_kind::metal:
+            attenuation = m.albedo;
+            return metal::scatter_ray(r_in, rec, m.param, scattered);
+
+        case material_kind::dielectric:
+            attenuation = m.albedo;
+            scattered = dielectric::scatter_ray(r_in, rec, m.param);
+            return true;
+
+        case material_kind::diffuse_light:
+            return false;
+
+        case material_kind::isotropic:
+            scattered = isotropic::scatter_ray(r_in, rec);
+            attenuation = shade_albedo(m, rec);
+            return true;
+
+        default:
+            return m.source->scatter(r_in, rec, attenuation, scattered);
+    }
+}
+
+inline double shade_pdf(
+    const material_record& m, const ray& r_in, const hit_record& rec, const vec3& direction
+) {
+    switch (m.kind) {
+        case material_kind::lambertian:    return lambertian::pdf(rec, direction);
+        case material_kind::metal:         return metal::pdf(r_in, rec, m.param, direction);
+        case material_kind::dielectric:    return 0;
+        case material_kind::diffuse_light: return 0;
+        case material_kind::isotropic:     return 1 / (4*pi);
+        default:                           return m.source->scattering_pdf(r_in, rec, direction);
+    }
+}
+
+inline color shade_eval(
+    const material_record& m, const ray& r_in, const hit_record& rec, const vec3& direction
+) {
+    switch (m.kind) {
+        case material_kind::lambertian:
+            return lambertian::pdf(rec, direction) * shade_albedo(m, rec);
+
+        case material_kind::metal:
+            if (dot(direction, rec.normal) <= 0) return color(0,0,0);
+            return metal::pdf(r_in, rec, m.param, direction) * m.albedo;
+
+        case material_kind::isotropic:
+            return shade_albedo(m, rec) / (4*pi);
+
+        case material_kind::dielectric:
+        case material_kind::diffuse_light:
+            return color(0,0,0);
+
+        default:
+            return m.source->eval(r_in, rec, direction);
+    }
+}
+
+#endif
@@ -0,0 +1,285 @@
+// This file defines metropolis_integrator, which renders by Metropolis light transport in
+// primary sample space (Kelemen et al., "A Simple and Robust Mutation Strategy for the
+// Metropolis Light Transport Algorithm"). A path is a function of the random numbers it
+// draws, so instead of drawing fresh numbers for every path, a Markov chain keeps the
+// numbers of its current path and proposes changes to them: small steps that nudge each
+// number, and large steps that draw them all anew. Proposals are accepted in proportion to
+// the brightness of the paths they give, so the chains spend their time on the paths that
+// carry the most light, and once one finds a rare path (into fog through glass, or out of a
+// light behind glass) it explores the paths nearby instead of losing it.
+//
+// Chains visit paths in proportion to their brightness, not their light, so the image
+// needs the scene's mean brightness to come out right; a bootstrap pass of independent
+// paths estimates it, and also picks where the chains start. The paths themselves come from
+// a kernel drawing its numbers from a sampler, the same interface the camera's paths use,
+// and land on pixels of the kernel's choosing.
+
+#ifndef METROPOLIS_H
+#define METROPOLIS_H
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Answers the draws of a path with the numbers of a chain's current path, mutated. The
+// first path draws fresh numbers; each iteration of the chain after it starts with
+// start_iteration() and ends with accept() or reject(). Numbers are mutated only when a
+// path first draws them in an iteration, and numbers left undrawn for a while catch up on
+// the small steps they missed.
+class metropolis_sampler : public sampler {
+  public:
+    // seed picks the numbers of the first path and every mutation after it.
+    explicit metropolis_sampler(uint64_t seed, double large_step_probability = 0.3,
+                                double step_width = 0.01)
+      : random(1, seed), large_step_probability(large_step_probability),
+        step_width(step_width) {}
+
+    // Starts a proposal, a large step or a small one, at the first dimension.
+    void start_iteration() {
+        iteration++;
+        large = random.next() < large_step_probability;
+        dimension = 0;
+    }
+
+    bool large_step() const { return large; }
+
+    void accept() {
+        if (large) last_large_step = iteration;
+    }
+
+    void reject() {
+        for (auto& x : numbers) {
+            if (x.modified == iteration) {
+                x.value = x.backup;
+                x.modified = x.backup_modified;
+            }
+        }
+        iteration--;
+    }
+
+    double get_1d() override {
+        mutate(dimension);
+        return numbers[dimension++].value;
+    }
+
+    sample_2d get_2d() override {
+        auto u = get_1d();
+        return {u, get_1d()};
+    }
+
+  private:
+    struct primary_number {
+        double value = 0;
+        int64_t modified = 0;  // Iteration the value was last mutated in
+        double backup = 0;     // Value and modified before the current iteration
+        int64_t backup_modified = 0;
+    };
+
+    random_numbers random;
+    double large_step_probability;
+    double step_width;  // Standard deviation of a small step
+    std::vector<primary_number> numbers;
+    int64_t iteration = 0;
+    int64_t last_large_step = 0;
+    bool large = true;
+
+    // Brings number i up to the current iteration. A number no path drew before starts
+    // uniformly random, as the current path would have drawn it. A number untouched since
+    // before the last accepted large step was drawn anew by it; one untouched for n small
+    // steps moves by their sum, a normal step sqrt(n) times as wide. Values wrap around
+    // [0,1).
+    void mutate(uint32_t i) {
+        while (i >= numbers.size())
+            numbers.push_back({random.next(), iteration});
+        auto& x = numbers[i];
+        if (x.modified < last_large_step) {
+            x.value = random.next();
+            x.modified = last_large_step;
+        }
+
+        x.backup = x.value;
+        x.backup_modified = x.modified;
+        if (large) {
+            x.value = random.next();
+        } else {
+            auto steps = double(iteration - x.modified);
+            x.value += normal() * step_width * std::sqrt(steps);
+            x.value = std::min(x.value - std::floor(x.value), 1 - 0x1p-53);
+        }
+        x.modified = iteration;
+    }
+
+    // A standard normal number, by the Box-Muller transform.
+    double normal() {
+        auto u = random.next_2d();
+        return std::sqrt(-2 * std::log(1 - u.u)) * std::cos(2*pi*u.v);
+    }
+};
+
+// The light a path brings and the pixel it lands on.
+struct path_sample {
+    int i, j;
+    color value;
+};
+
+class metropolis_integrator {
+  public:
+    using kernel = std::function<path_sample(sampler&)>;
+
+    // Renders a width by height image from the paths of path, which must be safe to call
+    // from several threads at once.
+    metropolis_integrator(int width, int height, kernel path)
+      : width(width), height(height), path(std::move(path)) {}
+
+    // Runs mutations_per_pixel mutations per pixel, spread over independent chains that
+    // the hardware threads take in turn, and returns each pixel's light summed so that
+    // dividing by mutations_per_pixel gives its mean. Every mutation adds both the proposed
+    // and the current path, weighted by the chance of accepting the proposal, which keeps
+    // the light of rejected proposals (Veach's expected values). Large steps are
+    // independent paths, so the mean brightness that scales the image is refined by theirs
+    // too (as in Kelemen et al.).
+    std::vector<color> render(int mutations_per_pixel) {
+        auto pixel_count = size_t(width) * height;
+        chain_output total{std::vector<color>(pixel_count, color(0,0,0))};
+        if (!bootstrap() || mutations_per_pixel <= 0) return total.image;
+
+        auto mutations = int64_t(mutations_per_pixel) * int64_t(pixel_count);
+        auto chains = int(std::min<int64_t>(chain_count, mutations));
+        std::atomic<int> next_chain{0};
+
+        auto work = [&](chain_output& out, bool report) {
+            while (true) {
+                auto chain = next_chain++;
+                if (chain >= chains) break;
+                if (report)
+                    std::clog << "\rChains remaining: " << (chains - chain) << ' ' << std::flush;
+                auto length = mutations / chains + (chain < mutations % chains ? 1 : 0);
+                run_chain(chain, length, out);
+            }
+        };
+
+        unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<chain_output> outputs(thread_count - 1, total);
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < thread_count; t++)
+            workers.emplace_back(work, std::ref(outputs[t - 1]), false);
+        work(total, true);
+        for (auto& worker : workers)
+            worker.join();
+
+        for (const auto& out : outputs) {
+            for (size_t p = 0; p < pixel_count; p++)
+                total.image[p] += out.image[p];
+            total.brightness += out.brightness;
+            total.paths += out.paths;
+        }
+
+        auto scale = (bootstrap_brightness + total.brightness) / (bootstrap_paths + total.paths);
+        for (auto& pixel_color : total.image)
+            pixel_color *= scale;
+        return total.image;
+    }
+
+  private:
+    static const int bootstrap_paths = 100000;
+    static const int chain_count = 1024;  // Many short chains, so few start in one place
+
+    int width, height;
+    kernel path;
+    std::vector<double> bootstrap_weights;  // Brightness of each bootstrap path
+    double bootstrap_brightness = 0;        // Their sum
+    alias_table starts;                     // Picks bootstrap paths by brightness
+
+    // What the chains of one thread add up.
+    struct chain_output {
+        std::vector<color> image;
+        double brightness = 0;  // Summed over the large steps
+        int64_t paths = 0;      // Large steps taken
+    };
+
+    // What a chain favors: the mean of a path's light over the channels, or zero for
+    // light that isn't a finite number, which no chain should stay on.
+    static double brightness(const color& c) {
+        auto b = (c.x() + c.y() + c.z()) / 3;
+        return std::isfinite(b) && b > 0 ? b : 0;
+    }
+
+    // Traces the bootstrap paths, each from the first numbers of a sampler seeded by its
+    // index. Returns false if none of them brings light.
+    bool bootstrap() {
+        bootstrap_weights.assign(bootstrap_paths, 0);
+        std::atomic<int> next{0};
+        auto work = [&] {
+            while (true) {
+                auto k = next++;
+                if (k >= bootstrap_paths) break;
+                metropolis_sampler samples(k);
+                bootstrap_weights[k] = brightness(path(samples).value);
+            }
+        };
+
+        std::clog << "\rBootstrap of " << bootstrap_paths << " paths " << std::flush;
+        unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < thread_count; t++)
+            workers.emplace_back(work);
+        work();
+        for (auto& worker : workers)
+            worker.join();
+
+        bootstrap_brightness = 0;
+        for (auto w : bootstrap_weights) bootstrap_brightness += w;
+        if (bootstrap_brightness <= 0) return false;
+        starts = alias_table(bootstrap_weights);
+        return true;
+    }
+
+    // Runs one chain for length mutations, adding its light to out. The chain starts from
+    // a bootstrap path picked by brightness, retraced from the same seed.
+    void run_chain(int chain, int64_t length, chain_output& out) const {
+        random_numbers random(2, uint64_t(chain));
+        auto start = starts.sample(random.next());
+        metropolis_sampler samples(start);
+        auto current = path(samples);
+        auto current_brightness = brightness(current.value);
+
+        for (int64_t m = 0; m < length; m++) {
+            samples.start_iteration();
+            auto proposed = path(samples);
+            auto proposed_brightness = brightness(proposed.value);
+            if (samples.large_step()) {
+                out.brightness += proposed_brightness;
+                out.paths++;
+            }
+            auto acceptance = current_brightness > 0
+                ? std::min(1.0, proposed_brightness / current_brightness) : 1.0;
+
+            if (proposed_brightness > 0)
+                add(out.image, proposed, acceptance / proposed_brightness);
+            if (current_brightness > 0)
+                add(out.image, current, (1 - acceptance) / current_brightness);
+
+            if (random.next() < acceptance) {
+                samples.accept();
+                current = proposed;
+                current_brightness = proposed_brightness;
+            } else {
+                samples.reject();
+            }
+        }
+    }
+
+    void add(std::vector<color>& image, const path_sample& s, double weight) const {
+        image[size_t(s.j) * width + s.i] += weight * s.value;
+    }
+};
+
+#endif
@@ -0,0 +1,129 @@
+// This file defines mipmap, a pyramid of successively halved copies of an image used to
+// filter texture lookups. A lookup covering many texels reads a smaller level, where each
+// texel already averages them, instead of aliasing on single texels of the full image.
+
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "rtweekend.h"
+#include "rtw_stb_image.h"
+#include "texture_storage.h"
+
+#include <vector>
+
+// Filtered lookups shared by mipmap and tiled_mipmap (see tile_cache.h). Pyramid provides
+// level_count(), level_width(), level_height() and texel(level, x, y).
+template <typename Pyramid>
+class mip_filtering {
+  public:
+    // Returns the texel of level 0 under image coordinates (x,y) in [0,1] x [0,1], y down.
+    color nearest(double x, double y) const {
+        return pyramid().texel(0, int(x * pyramid().level_width(0)),
+                                  int(y * pyramid().level_height(0)));
+    }
+
+    // Returns the color at image coordinates (x,y). lod is the level to read: fractional
+    // levels blend the two nearest levels.
+    color trilinear(double x, double y, double lod) const {
+        if (lod <= 0) return bilinear(0, x, y);
+
+        int last = pyramid().level_count() - 1;
+        if (lod >= last) return bilinear(last, x, y);
+
+        int level = int(lod);
+        auto t = lod - level;
+        return (1-t)*bilinear(level, x, y) + t*bilinear(level+1, x, y);
+    }
+
+    color bilinear(int level, double x, double y) const {
+        const auto& p = pyramid();
+
+        // Texel centers sit at half-integer coordinates.
+        auto fx = x * p.level_width(level) - 0.5;
+        auto fy = y * p.level_height(level) - 0.5;
+        auto i = int(std::floor(fx));
+        auto j = int(std::floor(fy));
+        auto tx = fx - i;
+        auto ty = fy - j;
+
+        auto top = (1-tx)*p.texel(level, i, j) + tx*p.texel(level, i+1, j);
+        auto bottom = (1-tx)*p.texel(level, i, j+1) + tx*p.texel(level, i+1, j+1);
+        return (1-ty)*top + ty*bottom;
+    }
+
+    // Returns the linear pixels of the level below above (width x height), and updates width
+    // and height to its size. Each texel is the average of the 2x2 block above it; odd edges
+    // reuse their last row or column.
+    static std::vector<float> half_level(const float* above, int& width, int& height) {
+        int half_width = width > 1 ? width / 2 : 1;
+        int half_height = height > 1 ? height / 2 : 1;
+        std::vector<float> pixels(3 * half_width * half_height);
+
+        auto at = [&](int x, int y, int c) {
+            x = x < width ? x : width - 1;
+            y = y < height ? y : height - 1;
+            return above[3*(y*width + x) + c];
+        };
+
+        for (int y = 0; y < half_height; y++)
+            for (int x = 0; x < half_width; x++)
+                for (int c = 0; c < 3; c++)
+                    pixels[3*(y*half_width + x) + c] = 0.25f * (at(2*x, 2*y, c) + at(2*x+1, 2*y, c)
+                                                       + at(2*x, 2*y+1, c) + at(2*x+1, 2*y+1, c));
+
+        width = half_width;
+        height = half_height;
+        return pixels;
+    }
+
+  protected:
+    static int clamp(int x, int size) { return x < 0 ? 0 : (x < size ? x : size - 1); }
+
+  private:
+    const Pyramid& pyramid() const { return static_cast<const Pyramid&>(*this); }
+};
+
+class mipmap : public mip_filtering<mipmap> {
+  public:
+    mipmap() {}
+
+    // Builds the pyramid down to a single texel, with every level stored in format. The
+    // levels are filtered from the image's linear pixels, which aren't kept.
+    mipmap(const rtw_image& image, texel_format format)
+      : mipmap(image.float_data(), image.width(), image.height(), format) {}
+
+    // Builds the pyramid of width x height linear RGB float pixels, stored by rows.
+    mipmap(const float* rgb, int width, int height, texel_format format) {
+        if (height <= 0) return;
+
+        levels.emplace_back(rgb, width, height, format);
+
+        std::vector<float> pixels;
+        while (width > 1 || height > 1) {
+            pixels = half_level(levels.size() == 1 ? rgb : pixels.data(), width, height);
+            levels.emplace_back(pixels.data(), width, height, format);
+        }
+    }
+
+    int level_count() const { return int(levels.size()); }
+    int level_width(int level) const { return levels[level].width(); }
+    int level_height(int level) const { return levels[level].height(); }
+
+    size_t size_in_bytes() const {
+        size_t size = 0;
+        for (const auto& l : levels)
+            size += l.size_in_bytes();
+        return size;
+    }
+
+    // Returns the texel at (x,y) of a level, clamping (x,y) to the level's edges.
+    color texel(int level, int x, int y) const {
+        const auto& l = levels[level];
+        return l.texel(clamp(x, l.width()), clamp(y, l.height()));
+    }
+
+  private:
+    std::vector<texture_storage> levels;
+};
+
+#endif
@@ -0,0 +1,281 @@
+// This file defines path_guide, a spatial-directional tree (SD-tree) that learns where light
+// arrives from at each part of the scene while rendering, following Müller et al.,
+// "Practical Path Guiding for Efficient Light-Transport Simulation". A binary tree splits
+// the scene's bounds into regions, and each region keeps a quadtree over directions whose
+// nodes sum the radiance recorded through them. The renderer records the light found along
+// its paths during a few training passes of doubling length, refining both trees between
+// passes, and afterwards scatters diffuse bounces partly by the learned distribution. That
+// finds light arriving through small openings or off glass far more often than scattering
+// by the surface alone.
+
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <vector>
+
+// A distribution over directions, stored as a quadtree over the unit square. The square maps
+// to the sphere by height and angle about the z axis, which preserves area, so a density
+// over the square is 4 pi times the density over solid angle.
+class directional_tree {
+  public:
+    directional_tree() : nodes(1) {}
+
+    // The point of the square of a direction, and back.
+
+    static sample_2d to_square(const vec3& direction) {
+        auto d = unit_vector(direction);
+        auto x = (std::clamp(double(d.z()), -1.0, 1.0) + 1) / 2;
+        auto phi = std::atan2(double(d.y()), double(d.x()));
+        if (phi < 0) phi += 2*pi;
+        return {std::min(x, 1 - 0x1p-53), std::min(phi / (2*pi), 1 - 0x1p-53)};
+    }
+
+    static vec3 to_direction(const sample_2d& s) {
+        auto z = 2*s.u - 1;
+        auto r = std::sqrt(std::max(0.0, 1 - z*z));
+        auto phi = 2*pi*s.v;
+        return vec3(r*std::cos(phi), r*std::sin(phi), z);
+    }
+
+    // The radiance recorded so far, summed over all directions.
+    double total() const {
+        const auto& root = nodes[0];
+        return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+    }
+
+    // Adds value to every node covering the point s.
+    void record(sample_2d s, double value) {
+        int n = 0;
+        while (true) {
+            auto q = quadrant(s);
+            nodes[n].sum[q] += value;
+            if (!nodes[n].child[q]) return;
+            n = nodes[n].child[q];
+        }
+    }
+
+    // Picks a point of the square by u in proportion to the recorded radiance: at each node
+    // u.u picks the left or right half and u.v a quadrant in it, and both are remapped to
+    // [0,1) for the next level, finally placing the point within a leaf.
+    sample_2d sample(sample_2d u) const {
+        double x0 = 0, y0 = 0, size = 1;
+        int n = 0;
+        while (true) {
+            const auto& node = nodes[n];
+            auto left = node.sum[0] + node.sum[2], right = node.sum[1] + node.sum[3];
+            if (left + right <= 0)
+                return {x0 + u.u * size, y0 + u.v * size};
+
+            int qx = pick(u.u, left / (left + right));
+            int qy = pick(u.v, node.sum[qx] / (node.sum[qx] + node.sum[qx + 2]));
+
+            size /= 2;
+            x0 += qx * size;
+            y0 += qy * size;
+            auto child = node.child[qx + 2*qy];
+            if (!child) return {x0 + u.u * size, y0 + u.v * size};
+            n = child;
+        }
+    }
+
+    // The density over the square with which sample() picks s.
+    double pdf(sample_2d s) const {
+        double density = 1;
+        int n = 0;
+        while (true) {
+            const auto& node = nodes[n];
+            auto sum = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            if (sum <= 0) return density;
+
+            auto q = quadrant(s);
+            density *= 4 * node.sum[q] / sum;
+            if (!node.child[q]) return density;
+            n = node.child[q];
+        }
+    }
+
+    // A tree without recorded radiance, subdivided down to the quadrants that hold more
+    // than the given fraction of this tree's radiance. The new leaves start from the sums
+    // of this tree, split evenly where it was coarser, so sampling it stays sensible.
+    directional_tree refined(double fraction, int max_depth) const {
+        directional_tree out;
+        auto limit = fraction * total();
+        if (limit <= 0) return out;
+
+        struct item {
+            int to, from;    // Node of out, and of this tree (-1 if finer than this tree)
+            double sum[4];   // Radiance under each quadrant
+            int depth;
+        };
+        std::vector<item> stack{{0, 0, {nodes[0].sum[0], nodes[0].sum[1], nodes[0].sum[2],
+                                        nodes[0].sum[3]}, 1}};
+        while (!stack.empty()) {
+            auto it = stack.back();
+            stack.pop_back();
+            for (int q = 0; q < 4; q++) {
+                if (it.sum[q] <= limit || it.depth >= max_depth) continue;
+
+                int child = int(out.nodes.size());
+                out.nodes.emplace_back();
+                out.nodes[it.to].child[q] = child;
+
+                item next{child, -1, {}, it.depth + 1};
+                auto from = it.from >= 0 ? nodes[it.from].child[q] : 0;
+                for (int k = 0; k < 4; k++)
+                    next.sum[k] = from ? nodes[from].sum[k] : it.sum[q] / 4;
+                if (from) next.from = from;
+                stack.push_back(next);
+            }
+        }
+        return out;
+    }
+
+  private:
+    struct node {
+        double sum[4] = {};  // Radiance recorded under each quadrant
+        int child[4] = {};   // Node subdividing each quadrant, or 0 for a leaf
+    };
+
+    // Quadrants are numbered by their x half plus twice their y half.
+    std::vector<node> nodes;
+
+    // The quadrant of s, with s rescaled to that quadrant.
+    static int quadrant(sample_2d& s) {
+        int qx = s.u >= 0.5, qy = s.v >= 0.5;
+        s.u = std::min(2*s.u - qx, 1 - 0x1p-53);
+        s.v = std::min(2*s.v - qy, 1 - 0x1p-53);
+        return qx + 2*qy;
+    }
+
+    // Picks 0 with probability p by u, remapping u to [0,1) within the pick.
+    static int pick(double& u, double p) {
+        if (u < p) {
+            u = std::min(u / p, 1 - 0x1p-53);
+            return 0;
+        }
+        u = std::min((u - p) / (1 - p), 1 - 0x1p-53);
+        return 1;
+    }
+};
+
+// A leaf of the spatial tree: the distribution learned so far, which paths sample, and the
+// one being recorded in the current training pass.
+struct guide_region {
+    directional_tree sampling;
+    directional_tree building;
+    double records = 0;  // Records in building
+
+    bool learned() const { return sampling.total() > 0; }
+
+    vec3 sample(const sample_2d& u) const {
+        return directional_tree::to_direction(sampling.sample(u));
+    }
+
+    // Density over solid angle of sample() picking direction.
+    double pdf(const vec3& direction) const {
+        return sampling.pdf(directional_tree::to_square(direction)) / (4*pi);
+    }
+
+    // Records the radiance arriving from direction, estimated by a sample taken with the
+    // given density.
+    void record(const vec3& direction, double radiance, double pdf) {
+        if (!(radiance > 0) || !(pdf > 0) || !std::isfinite(radiance / pdf)) return;
+        building.record(directional_tree::to_square(direction), radiance / pdf);
+        records++;
+    }
+};
+
+class path_guide {
+  public:
+    // Covers bounds, which all recorded and guided points should fall in.
+    explicit path_guide(const aabb& bounds) : nodes{{bounds, 0, 0, {0, 0}, 0}}, regions(1) {}
+
+    int region_count() const { return int(regions.size()); }
+
+    // The region containing p. Points outside the bounds go to the nearest region.
+    guide_region* find(const point3& p) {
+        int n = 0;
+        while (nodes[n].region < 0) {
+            const auto& node = nodes[n];
+            n = node.child[p[node.axis] < node.split ? 0 : 1];
+        }
+        return &regions[nodes[n].region];
+    }
+
+    // Ends a training pass of the given samples per pixel. Regions that received many
+    // records are split in two along their longest axis, repeatedly, so their parts get
+    // fewer than the threshold; the threshold grows with the square root of the pass length,
+    // as the passes double. Then every region samples from what it recorded and starts
+    // recording into a finer tree.
+    void refine(int pass_samples) {
+        auto threshold = spatial_threshold * std::sqrt(double(pass_samples));
+        for (int n = 0; n < int(nodes.size()); n++) {
+            if (nodes[n].region < 0 || nodes[n].depth >= max_spatial_depth) continue;
+            if (regions[nodes[n].region].records <= threshold) continue;
+            split(n);
+        }
+
+        for (auto& r : regions) {
+            r.sampling = r.building;
+            r.building = r.sampling.refined(directional_fraction, max_directional_depth);
+            r.records = 0;
+        }
+    }
+
+  private:
+    struct spatial_node {
+        aabb bounds;
+        int region;    // Region of a leaf, or -1
+        int axis;      // Split axis and position of an inner node
+        int child[2];
+        int depth;
+        double split = 0;
+    };
+
+    // Splitting thresholds, scaled down from the paper's for this renderer's smaller images.
+    static constexpr double spatial_threshold = 1000;   // Records per region and pass
+    static constexpr double directional_fraction = 0.01;  // Radiance per directional leaf
+    static const int max_spatial_depth = 48;
+    static const int max_directional_depth = 20;
+
+    std::vector<spatial_node> nodes;
+    std::vector<guide_region> regions;
+
+    // Splits leaf n; both halves start with its directional trees and half its records,
+    // which are split again below if need be.
+    void split(int n) {
+        auto node = nodes[n];
+        auto axis = node.bounds.longest_axis();
+        auto range = node.bounds.axis_interval(axis);
+        auto middle = (range.min + range.max) / 2;
+
+        auto half = regions[node.region];
+        half.records /= 2;
+        regions[node.region] = half;
+        regions.push_back(half);
+
+        int children[2];
+        for (int side = 0; side < 2; side++) {
+            interval sides[3] = {node.bounds.x, node.bounds.y, node.bounds.z};
+            (side ? sides[axis].min : sides[axis].max) = middle;
+            auto bounds = aabb(sides[0], sides[1], sides[2]);
+
+            children[side] = int(nodes.size());
+            int region = side ? int(regions.size()) - 1 : node.region;
+            nodes.push_back({bounds, region, 0, {0, 0}, node.depth + 1});
+        }
+
+        nodes[n].region = -1;
+        nodes[n].axis = axis;
+        nodes[n].split = middle;
+        nodes[n].child[0] = children[0];
+        nodes[n].child[1] = children[1];
+    }
+};
+
+#endif
@@ -0,0 +1,349 @@
+// This file defines photon_map, which renders caustics: light focused onto diffuse surfaces
+// through glass and mirrors. A path traced from the camera finds such light only when a
+// diffuse bounce happens to scatter through the glass onto a light, which small lights make
+// rare. The photon map traces light the other way before rendering: photons leave the
+// lights (and the sky, aimed at the glass and mirrors), bounce off specular surfaces and are
+// stored where they land on a diffuse one. The camera then estimates the caustic light at
+// its diffuse hits from the photons nearby (Jensen, "Global Illumination using Photon
+// Maps"), and leaves the light paths that the map holds out of its own estimate. Objects
+// that can't be flattened (see hittable::flatten) aren't aimed at, so the caustics of sky
+// light through them are left to the camera's paths.
+//
+// Photons are stored in a kd-tree laid out in a flat array. Their count is capped, so a map
+// takes bounded memory however many photons the renderer asks for over several passes.
+
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "environment.h"
+#include "hittable.h"
+#include "light_list.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Whether m scatters into a single direction: glass, and mirrors without fuzz.
+inline bool is_specular(const material_record& m) {
+    return m.kind == material_kind::dielectric || (m.kind == material_kind::metal && m.param == 0);
+}
+
+class photon_map : public scene_compiler {
+  public:
+    // Collects the specular objects of the scene graph rooted at world, which photons from
+    // the sky are aimed at. lights are the lights photons are emitted from, and sky the
+    // light arriving from outside the scene: env if not null, or else the background color.
+    photon_map(const hittable& world, const light_list& lights, const color& background,
+               const environment* env)
+      : lights(lights), background(background), env(env), bounds(world.bounding_box())
+    {
+        add_object(world, rigid_transform());
+        std::vector<double> areas;
+        for (const auto& t : targets)
+            areas.push_back(t.radius * t.radius);
+        by_area = alias_table(areas);
+
+        auto lit = env || background.x() > 0 || background.y() > 0 || background.z() > 0;
+        sky_photons = lit && !targets.empty();
+    }
+
+    // Traces photons through world, until max_photons are stored or a limit of emitted
+    // photons is reached, on all hardware threads. seed picks the photons' random numbers,
+    // so each pass of a progressive render traces new ones.
+    void trace(const hittable& world, int max_photons, uint64_t seed) {
+        photons.clear();
+        emitted = 0;
+        if (lights.empty() && !sky_photons) return;
+
+        // Most photons miss the specular objects; stop if too few land, and keep every
+        // batch whole so the flux of the stored photons divides by the exact count emitted.
+        auto max_emitted = int64_t(max_photons) * emitted_per_stored;
+        std::atomic<int64_t> next_batch{0};
+        std::atomic<bool> full{false};
+        std::mutex storing;
+
+        auto work = [&] {
+            std::vector<photon> found;
+            while (!full) {
+                auto batch = next_batch++;
+                if (batch * batch_size >= max_emitted) break;
+
+                found.clear();
+                random_numbers random{seed, uint64_t(batch)};
+                for (int i = 0; i < batch_size; i++)
+                    trace_photon(world, random, found);
+
+                std::lock_guard<std::mutex> lock(storing);
+                if (full || photons.size() + found.size() > size_t(max_photons)) {
+                    full = true;
+                    break;
+                }
+                photons.insert(photons.end(), found.begin(), found.end());
+                emitted += batch_size;
+            }
+        };
+
+        unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < thread_count; i++)
+            workers.emplace_back(work);
+        work();
+        for (auto& worker : workers)
+            worker.join();
+
+        for (auto& p : photons)
+            for (auto& f : p.flux) f /= float(emitted);
+        build(0, int(photons.size()));
+    }
+
+    int size() const { return int(photons.size()); }
+    int64_t emitted_count() const { return emitted; }
+
+    // Whether the map holds the caustics of surfaces of mat, a light.
+    bool emits(const material* mat) const { return lights.emits(mat); }
+
+    // Whether the map holds the caustics of the sky light arriving back along r, a ray
+    // leaving the scene: sky photons travel every line through a target.
+    bool covers_sky(const ray& r) const {
+        if (!sky_photons) return false;
+        auto d = unit_vector(r.direction());
+        for (const auto& t : targets) {
+            auto offset = r.origin() - t.center;
+            auto across = offset - dot(offset, d) * d;
+            if (across.length_squared() <= t.radius * t.radius) return true;
+        }
+        return false;
+    }
+
+    // The caustic light arriving at p per unit area, on the side of the surface normal n
+    // faces: the flux of the photons within radius of p, over the disk they cover.
+    color irradiance(const point3& p, const vec3& n, double radius) const {
+        color sum(0,0,0);
+        if (photons.empty()) return sum;
+
+        float q[3] = {float(p.x()), float(p.y()), float(p.z())};
+        auto radius_squared = float(radius * radius);
+
+        // Ranges of the array still to search; the middle photon of each splits the rest.
+        struct range { int begin, end; };
+        range stack[64];
+        int top = 0;
+        stack[top++] = {0, int(photons.size())};
+        while (top > 0) {
+            auto r = stack[--top];
+            if (r.begin >= r.end) continue;
+
+            int middle = (r.begin + r.end) / 2;
+            const auto& ph = photons[middle];
+            float d[3] = {q[0] - ph.position[0], q[1] - ph.position[1], q[2] - ph.position[2]};
+            if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] <= radius_squared) {
+                auto facing = ph.direction[0]*n.x() + ph.direction[1]*n.y() + ph.direction[2]*n.z();
+                if (facing < 0) sum += color(ph.flux[0], ph.flux[1], ph.flux[2]);
+            }
+
+            // The near side always, the far side if the split plane is within radius.
+            auto offset = d[ph.axis];
+            range below{r.begin, middle}, above{middle + 1, r.end};
+            if (offset * offset <= radius_squared)
+                stack[top++] = offset < 0 ? above : below;
+            stack[top++] = offset < 0 ? below : above;
+        }
+        return sum / (pi * radius * radius);
+    }
+
+    // Scene compiler interface, called while walking the scene graph.
+
+    void add_object(const hittable& object, const rigid_transform& to_world) override {
+        object.flatten(*this, to_world);
+    }
+
+    bool add_sphere(const point3& center, const vec3& center_vec, double radius,
+                    const shared_ptr<material>& mat) override {
+        // Moving spheres are bounded over their whole motion.
+        if (specular(mat))
+            targets.push_back({center + center_vec / 2, radius + center_vec.length() / 2});
+        return true;
+    }
+
+    bool add_quad(const point3& Q, const vec3& u, const vec3& v,
+                  const shared_ptr<material>& mat) override {
+        if (specular(mat))
+            targets.push_back({Q + (u + v) / 2, (u + v).length() / 2 + 1e-4});
+        return true;
+    }
+
+    bool add_triangle(const point3& Q, const vec3& u, const vec3& v,
+                      const shared_ptr<material>& mat) override {
+        if (specular(mat)) {
+            auto center = Q + (u + v) / 3;
+            auto radius = std::max({(Q - center).length(), (Q + u - center).length(),
+                                    (Q + v - center).length()});
+            targets.push_back({center, radius + 1e-4});
+        }
+        return true;
+    }
+
+    bool add_medium(const hittable& boundary, double neg_inv_density,
+                    const shared_ptr<material>& phase_function,
+                    const rigid_transform& to_world) override {
+        return true;  // Photons stop at media, so they aren't aimed at them
+    }
+
+  private:
+    // Stored in single precision to keep maps of many photons small.
+    struct photon {
+        float position[3];
+        float direction[3];  // Direction the photon traveled in
+        float flux[3];       // Power it carries, once divided by the photons emitted
+        int axis;            // Split axis of its kd-tree node
+    };
+
+    // A bounding sphere of a specular object.
+    struct target {
+        point3 center;
+        double radius;
+    };
+
+    static const int batch_size = 1024;
+    static const int emitted_per_stored = 20;  // Emission limit per photon asked for
+    static const int max_bounces = 16;
+
+    const light_list& lights;
+    color background;
+    const environment* env;
+    aabb bounds;
+    std::vector<target> targets;
+    alias_table by_area;  // Picks targets by cross section
+    bool sky_photons = false;
+
+    std::vector<photon> photons;
+    int64_t emitted = 0;
+
+    static bool specular(const shared_ptr<material>& mat) {
+        return mat && is_specular(mat->record());
+    }
+
+    // Emits a photon from the lights or the sky and follows it through specular bounces,
+    // adding it to found if it then lands on a diffuse surface.
+    void trace_photon(const hittable& world, random_numbers& random, std::vector<photon>& found) const {
+        // With both kinds of light, each emits half the photons.
+        auto pick = random.next();
+        auto point = random.next_2d();
+        auto direction = random.next_2d();
+        auto time = random.next();
+
+        ray r;
+        color flux;
+        light_emission e;
+        bool from_sky = sky_photons && (lights.empty() || pick < 0.5);
+        double share = lights.empty() || !sky_photons ? 1.0 : 0.5;
+        if (from_sky) {
+            if (!emit_from_sky(pick / share, point, direction, time, r, flux)) return;
+        } else {
+            if (sky_photons) pick = (pick - 0.5) / share;
+            if (!lights.emit(pick, point, direction, time, e)) return;
+            r = e.r;
+            flux = e.flux();
+        }
+        flux /= share;
+
+        stream_sampler media(random);  // Media draw from the photon's stream too
+        for (int bounce = 0; bounce < max_bounces; bounce++) {
+            hit_record rec;
+            rec.samples = &media;
+            if (!world.hit(r, interval(0.001, infinity), rec)) return;
+            rec.object->compute_surface(r, rec);
+
+            const material_record& m = rec.shading ? *rec.shading : rec.mat->record();
+            if (m.kind == material_kind::lambertian) {
+                // Only light that came off a specular surface is a caustic.
+                if (bounce > 0) found.push_back(stored(rec.p, r.direction(), flux));
+                return;
+            }
+            if (!is_specular(m)) return;
+
+            rec.sample[0] = random.next();
+            rec.sample[1] = random.next();
+            rec.sample[2] = random.next();
+            color attenuation;
+            ray scattered;
+            if (!shade_scatter(m, r, rec, attenuation, scattered)) return;
+            flux = flux * attenuation;
+            r = scattered;
+        }
+    }
+
+    // Starts a photon from the sky toward a specular object: a target picked by its cross
+    // section, a uniform direction, and a uniform point on the target's disk facing it. A
+    // line can cross several targets' disks, so its density sums over all of them.
+    bool emit_from_sky(double pick, const sample_2d& point, const sample_2d& direction,
+                       double time, ray& r, color& flux) const {
+        const auto& t = targets[by_area.sample(pick)];
+        auto d = sample_unit_vector(direction.u, direction.v);
+        auto a = std::fabs(d.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0);
+        auto e1 = unit_vector(cross(d, a));
+        auto e2 = cross(d, e1);
+        auto disk = sample_in_unit_disk(point.u, point.v);
+        auto p = t.center + t.radius * (disk.x() * e1 + disk.y() * e2);
+
+        double density = 0;
+        for (int i = 0; i < int(targets.size()); i++) {
+            auto offset = p - targets[i].center;
+            auto across = offset - dot(offset, d) * d;
+            auto radius_squared = targets[i].radius * targets[i].radius;
+            if (across.length_squared() <= radius_squared)
+                density += by_area.pmf(i) / (pi * radius_squared);
+        }
+        density /= 4*pi;
+        if (density <= 0) return false;
+
+        // Start outside the scene, so whatever blocks the sky blocks the photon.
+        auto far = (bounds.x.size() + bounds.y.size() + bounds.z.size());
+        r = ray(p - far * d, d, time);
+        flux = (env ? env->radiance(-d) : background) / density;
+        return true;
+    }
+
+    static photon stored(const point3& p, const vec3& direction, const color& flux) {
+        auto d = unit_vector(direction);
+        return {{float(p.x()), float(p.y()), float(p.z())},
+                {float(d.x()), float(d.y()), float(d.z())},
+                {float(flux.x()), float(flux.y()), float(flux.z())}, 0};
+    }
+
+    // Orders photons[begin, end) into a kd-tree: the median along the longest extent goes
+    // in the middle, with the photons below it before and above it after, recursively.
+    void build(int begin, int end) {
+        if (end - begin <= 1) return;
+
+        float low[3], high[3];
+        for (int k = 0; k < 3; k++) low[k] = high[k] = photons[begin].position[k];
+        for (int i = begin + 1; i < end; i++) {
+            for (int k = 0; k < 3; k++) {
+                low[k] = std::min(low[k], photons[i].position[k]);
+                high[k] = std::max(high[k], photons[i].position[k]);
+            }
+        }
+        int axis = 0;
+        for (int k = 1; k < 3; k++)
+            if (high[k] - low[k] > high[axis] - low[axis]) axis = k;
+
+        int middle = (begin + end) / 2;
+        std::nth_element(photons.begin() + begin, photons.begin() + middle, photons.begin() + end,
+                         [axis](const photon& a, const photon& b) {
+                             return a.position[axis] < b.position[axis];
+                         });
+        photons[middle].axis = axis;
+        build(begin, middle);
+        build(middle + 1, end);
+    }
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include "hittable.h"
 #include "hittable_list.h"
 
+#include <typeinfo>
+
 class quad : public hittable {
   public:
     quad(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat)
@@ -13,6 +15,7 @@ class quad : public hittable {
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n,n);
+        uv_scale = 1 / std::sqrt(u.length() * v.length());
 
         set_bounding_box();
     }
@@ -47,17 +50,31 @@ class quad : public hittable {
         if (!is_interior(alpha, beta, rec))
             return false;
 
-        // Ray hits the 2D shape; set the rest of the hit record and return true.
+        // Ray hits the 2D shape; the rest of the hit record is set by compute_surface().
 
         rec.t = t;
-        rec.p = intersection;
+        rec.object = this;
+
+        return true;
+    }
+
+    void compute_surface(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
         rec.mat = mat;
         rec.set_face_normal(r, normal);
+        rec.uv_scale = uv_scale;
+    }
 
-        return true;
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        // Shapes derived from quad override is_interior(), which the compiled scene can't
+        // reproduce, so only plain quads are flattened.
+        if (typeid(*this) != typeid(quad))
+            return false;
+
+        return compiler.add_quad(to_world.point(Q), to_world.vector(u), to_world.vector(v), mat);
     }
 
-    virtual bool is_interior(double a, double b, hit_record& rec) const {
+    virtual bool is_interior(real a, real b, hit_record& rec) const {
         interval unit_interval = interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
         // primitive, otherwise set the hit record UV coordinates and return true.
@@ -77,7 +94,8 @@ class quad : public hittable {
     shared_ptr<material> mat;
     aabb bbox;
     vec3 normal;
-    double D;
+    real D;
+    real uv_scale;  // See hit_record::uv_scale
 };
 
 inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
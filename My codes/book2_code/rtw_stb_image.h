@@ -10,34 +10,50 @@
 #define STBI_FAILURE_USERMSG
 #include "stb_image.h"
 
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <string>
 
 class rtw_image {
   public:
     rtw_image() {}
 
     rtw_image(const char* image_filename) {
-        auto filename = std::string(image_filename);
-        auto imagedir = getenv("RTW_IMAGES");
-
-        if (imagedir && load(std::string(imagedir) + "/" + filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../\/images/" + filename)) return;
-        if (load("../../../\/\/images/" + filename)) return;
-        if (load("../../../\/\/\/images/" + filename)) return;
-        if (load("../../../\/\/\/\/images/" + filename)) return;
+        auto path = resolve(image_filename);
+        if (load(path)) return;
 
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
         std::cerr << "       Reason: " << stbi_failure_reason() << "\n";
     }
 
+    // Returns the path of the first existing file among the places an image named
+    // image_filename is looked for: RTW_IMAGES, the current directory, and images/
+    // directories up to three levels up. Returns image_filename itself if none exists.
+    static std::string resolve(const char* image_filename) {
+        auto filename = std::string(image_filename);
+        auto imagedir = getenv("RTW_IMAGES");
+
+        std::string candidates[] = {
+            imagedir ? std::string(imagedir) + "/" + filename : std::string(),
+            filename,
+            "images/" + filename,
+            "../images/" + filename,
+            "../../images/" + filename,
+            "../../../images/" + filename,
+        };
+
+        for (const auto& path : candidates) {
+            if (path.empty()) continue;
+            if (auto file = std::fopen(path.c_str(), "rb")) {
+                std::fclose(file);
+                return path;
+            }
+        }
+        return filename;
+    }
+
     ~rtw_image() {
-        delete[] bdata;
         stbi_image_free(fdata);
     }
 
@@ -46,55 +62,21 @@ class rtw_image {
         fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
         if (fdata == nullptr) return false;
 
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
         return true;
     }
 
     int width()  const { return (fdata == nullptr) ? 0 : image_width; }
     int height() const { return (fdata == nullptr) ? 0 : image_height; }
 
-    const unsigned char* pixel_data(int x, int y) const {
-        static unsigned char magenta[] = { 255, 0, 255 };
-        if (bdata == nullptr) return magenta;
-
-        x = clamp(x, 0, image_width);
-        y = clamp(y, 0, image_height);
-
-        return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
-    }
+    // Linear RGB pixels, stored by rows. Textures encode these into a compact
+    // texture_storage and let the image go (see texture_storage.h).
+    const float* float_data() const { return fdata; }
 
   private:
     const int      bytes_per_pixel = 3;
     float         *fdata = nullptr;         // Linear floating point pixel data
-    unsigned char *bdata = nullptr;         // Linear 8-bit pixel data
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
-    int            bytes_per_scanline = 0;
-
-    static int clamp(int x, int low, int high) {
-        if (x < low) return low;
-        if (x < high) return x;
-        return high - 1;
-    }
-
-    static unsigned char float_to_byte(float value) {
-        if (value <= 0.0)
-            return 0;
-        if (1.0 <= value)
-            return 255;
-        return static_cast<unsigned char>(256.0 * value);
-    }
-
-    void convert_to_bytes() {
-        int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
-
-        auto *bptr = bdata;
-        auto *fptr = fdata;
-        for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
-            *bptr = float_to_byte(*fptr);
-    }
 };
 
 #ifdef _MSC_VER
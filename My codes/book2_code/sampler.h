@@ -0,0 +1,295 @@
+// This file defines the samplers that pick the random numbers of each camera path, and the
+// warps that turn those numbers into points and directions. A path draws its numbers in a
+// fixed order (pixel offset, lens position, time, then a few per bounce), and a sampler
+// answers each draw with a value for that dimension of that pixel sample. Besides
+// independent random numbers there are stratified and Owen-scrambled Sobol samplers, whose
+// values spread evenly over the samples of a pixel, so images converge faster at equal
+// sample counts.
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// Two numbers in [0,1) drawn together, so the sampler can spread them jointly.
+struct sample_2d {
+    double u, v;
+};
+
+// Warps of uniform numbers in [0,1) to the shapes the random_* functions of vec3.h sample.
+
+// A uniform direction, by the height and angle of a point on the unit sphere.
+inline vec3 sample_unit_vector(double u1, double u2) {
+    auto z = 1 - 2*u1;
+    auto r = std::sqrt(std::max(0.0, 1 - z*z));
+    auto phi = 2*pi*u2;
+    return vec3(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+// A uniform point in the unit ball: a direction and a radius with density 3r^2.
+inline vec3 sample_in_unit_sphere(double u1, double u2, double u3) {
+    return std::cbrt(u3) * sample_unit_vector(u1, u2);
+}
+
+// A uniform point in the unit disk in the xy plane. The concentric map sends squares
+// around the center of [0,1)^2 to rings, keeping stratified samples well spread.
+inline vec3 sample_in_unit_disk(double u1, double u2) {
+    auto a = 2*u1 - 1, b = 2*u2 - 1;
+    if (a == 0 && b == 0) return vec3(0,0,0);
+
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = pi/2 - (pi/4) * (a/b);
+    }
+    return vec3(r*std::cos(phi), r*std::sin(phi), 0);
+}
+
+// A SplitMix64 stream of uniform numbers in [0,1), for work spread over threads: the
+// renderer's rand() based random_double() is shared by all of them. Each (seed, stream)
+// pair gives a stream of its own. The seed is mixed first, since SplitMix64 states a
+// multiple of its increment apart give the same numbers shifted.
+struct random_numbers {
+    uint64_t state;
+    random_numbers(uint64_t seed, uint64_t stream) : state(mix(seed) ^ stream) {}
+
+    double next() {
+        return std::min((mix(state += 0x9e3779b97f4a7c15ull) >> 11) * 0x1p-53, 1 - 0x1p-53);
+    }
+
+    sample_2d next_2d() {
+        auto u = next();
+        return {u, next()};
+    }
+
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+};
+
+enum class sampler_kind {
+    independent,  // Every number independently random
+    stratified,   // Jittered strata of each dimension, shuffled per pixel and dimension
+    sobol         // Owen-scrambled Sobol points, shuffled per pixel and dimension
+};
+
+inline const char* sampler_kind_name(sampler_kind kind) {
+    switch (kind) {
+        case sampler_kind::stratified: return "stratified";
+        case sampler_kind::sobol:      return "sobol";
+        default:                       return "independent";
+    }
+}
+
+// Picks the numbers of one pixel sample after another. Each get_1d() or get_2d() call is
+// the next dimension of the current sample, so the renderer must draw them in the same
+// order for every sample of a pixel for them to be spread evenly.
+class sampler {
+  public:
+    virtual ~sampler() = default;
+
+    // Starts the sample_index-th sample of pixel (i, j) at its first dimension.
+    void start_pixel_sample(int i, int j, int sample_index) {
+        pixel = (uint64_t(uint32_t(j)) << 32) | uint32_t(i);
+        index = uint32_t(sample_index);
+        dimension = 0;
+    }
+
+    virtual double get_1d() = 0;
+    virtual sample_2d get_2d() = 0;
+
+  protected:
+    uint64_t pixel = 0;      // Pixel coordinates, packed for hashing
+    uint32_t index = 0;      // Sample index within the pixel
+    uint32_t dimension = 0;  // Draws made so far for this sample
+
+    // A seed for the current dimension of the current pixel.
+    uint32_t dimension_seed() const { return uint32_t(mix_bits(mix_bits(pixel) ^ dimension)); }
+
+    static uint64_t mix_bits(uint64_t v) {
+        v ^= v >> 31;
+        v *= 0x7fb5d329728ea185ull;
+        v ^= v >> 27;
+        v *= 0x81dadef4bc2dd44dull;
+        v ^= v >> 33;
+        return v;
+    }
+
+    // Element i of a random permutation of [0,n) picked by seed, computed by hashing
+    // without storing the permutation (Kensler, "Correlated Multi-Jittered Sampling").
+    static uint32_t permutation_element(uint32_t i, uint32_t n, uint32_t seed) {
+        uint32_t w = n - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= seed;
+            i *= 0xe170893d;
+            i ^= seed >> 16;
+            i ^= (i & w) >> 4;
+            i ^= seed >> 8;
+            i *= 0x0929eb3f;
+            i ^= seed >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | seed >> 27;
+            i *= 0x6935fa69;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3df;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= n);
+        return (i + seed) % n;
+    }
+
+    // Fixed-point fraction of 2^32 to double, kept below 1.
+    static double to_unit(uint32_t bits) {
+        return std::min(bits * 0x1p-32, 1 - 0x1p-53);
+    }
+};
+
+class independent_sampler : public sampler {
+  public:
+    double get_1d() override { return random_double(); }
+
+    sample_2d get_2d() override {
+        auto u = random_double();
+        return {u, random_double()};
+    }
+};
+
+// Draws every number from a random_numbers stream, for paths that aren't pixel samples,
+// such as photons.
+class stream_sampler : public sampler {
+  public:
+    explicit stream_sampler(random_numbers& random) : random(random) {}
+
+    double get_1d() override { return random.next(); }
+    sample_2d get_2d() override { return random.next_2d(); }
+
+  private:
+    random_numbers& random;
+};
+
+// Splits each dimension into strata, one per sample of the pixel: samples_per_pixel
+// intervals in 1D and a grid of about as many cells in 2D. Samples take the strata in an
+// order shuffled per pixel and dimension, so dimensions don't correlate, and jitter within
+// them.
+class stratified_sampler : public sampler {
+  public:
+    explicit stratified_sampler(int samples_per_pixel)
+      : count(uint32_t(std::max(1, samples_per_pixel)))
+    {
+        columns = uint32_t(std::ceil(std::sqrt(double(count))));
+        rows = (count + columns - 1) / columns;
+    }
+
+    double get_1d() override {
+        auto stratum = permutation_element(index % count, count, dimension_seed());
+        dimension++;
+        return (stratum + random_double()) / count;
+    }
+
+    // With fewer samples than grid cells, the samples take distinct random cells.
+    sample_2d get_2d() override {
+        auto cells = columns * rows;
+        auto cell = permutation_element(index % cells, cells, dimension_seed());
+        dimension++;
+        auto u = (cell % columns + random_double()) / columns;
+        return {u, (cell / columns + random_double()) / rows};
+    }
+
+  private:
+    uint32_t count;          // Strata per 1D dimension
+    uint32_t columns, rows;  // Strata grid of 2D dimensions
+};
+
+// The first two dimensions of the Sobol sequence, a (0,2)-sequence whose every power-of-two
+// run of points stratifies [0,1)^2 in all elementary intervals. Each dimension the renderer
+// draws gets its own copy of these points: the sample index is shuffled and the point's
+// digits Owen-scrambled with seeds hashed from the pixel and dimension (Burley, "Practical
+// Hash-based Owen Scrambling"). The shuffle keeps each pixel on the first
+// samples_per_pixel points. Scrambling keeps the stratification and makes each point
+// uniformly random, so estimates stay unbiased.
+class sobol_sampler : public sampler {
+  public:
+    explicit sobol_sampler(int samples_per_pixel)
+      : count(uint32_t(std::max(1, samples_per_pixel))) {}
+
+    double get_1d() override {
+        auto seed = dimension_seed();
+        dimension++;
+        auto i = permutation_element(index % count, count, seed);
+        return to_unit(owen_scramble(reverse_bits(i), hash(seed, 1)));
+    }
+
+    sample_2d get_2d() override {
+        auto seed = dimension_seed();
+        dimension++;
+        auto i = permutation_element(index % count, count, seed);
+        auto u = to_unit(owen_scramble(reverse_bits(i), hash(seed, 1)));
+        return {u, to_unit(owen_scramble(sobol_second(i), hash(seed, 2)))};
+    }
+
+  private:
+    uint32_t count;  // Samples per pixel: each pixel uses the first count points
+
+    static uint32_t hash(uint32_t seed, uint32_t salt) {
+        return uint32_t(mix_bits((uint64_t(seed) << 32) | salt));
+    }
+
+    static uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+        x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+        x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+        x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+        return x;
+    }
+
+    // The second Sobol dimension as a 32-bit fraction. Its direction numbers follow from
+    // the primitive polynomial x + 1: each is the previous one xor itself shifted right.
+    static uint32_t sobol_second(uint32_t i) {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+            if (i & 1) result ^= v;
+        }
+        return result;
+    }
+
+    // Flips each bit of x by a hash of the bits above it, a random nested permutation of
+    // the dyadic intervals x lies in. The hash only mixes lower bits into higher ones, so it
+    // runs on the reversed bits (Laine and Karras).
+    static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47c;
+        x ^= x * 0xb82f1e52;
+        x ^= x * 0xc7afe638;
+        x ^= x * 0x8d22f6e6;
+        return reverse_bits(x);
+    }
+};
+
+inline std::unique_ptr<sampler> make_sampler(sampler_kind kind, int samples_per_pixel) {
+    switch (kind) {
+        case sampler_kind::stratified: return std::make_unique<stratified_sampler>(samples_per_pixel);
+        case sampler_kind::sobol:      return std::make_unique<sobol_sampler>(samples_per_pixel);
+        default:                       return std::make_unique<independent_sampler>();
+    }
+}
+
+#endif
@@ -0,0 +1,75 @@
+// This file detects which SIMD instruction sets the running CPU supports, and provides
+// a small helper for picking the best implementation of a kernel at runtime. This lets
+// one binary use AVX2 kernels where available and still run on older CPUs. AVX2 is the
+// widest level: the kernels work on 8 floats at a time (a sphere leaf, a batch of noise
+// octaves), which one AVX2 register holds, so AVX-512 machines run the AVX2 kernels.
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define RTW_X86 1
+    #include <immintrin.h>
+
+    // Compile a single function for a newer instruction set than the rest of the program.
+    // Only call such functions after checking cpu_simd_level().
+    #define RTW_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+    #define RTW_TARGET_AVX2
+#endif
+
+enum class simd_level { scalar, sse2, avx2 };
+
+inline const char* simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::sse2: return "sse2";
+        case simd_level::avx2: return "avx2";
+        default:               return "scalar";
+    }
+}
+
+inline simd_level detect_simd_level() {
+#ifdef RTW_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return simd_level::avx2;
+    if (__builtin_cpu_supports("sse2")) return simd_level::sse2;
+#endif
+    return simd_level::scalar;
+}
+
+// The SIMD level used for dispatch: the best one the CPU supports, detected once. Setting the
+// RTW_SIMD environment variable (e.g. RTW_SIMD=sse2) caps it, to compare kernels on one machine.
+inline simd_level cpu_simd_level() {
+    static const simd_level level = [] {
+        auto level = detect_simd_level();
+        if (auto cap = std::getenv("RTW_SIMD")) {
+            for (auto l : {simd_level::scalar, simd_level::sse2, simd_level::avx2}) {
+                if (std::strcmp(cap, simd_level_name(l)) == 0 && l < level)
+                    level = l;
+            }
+        }
+        return level;
+    }();
+    return level;
+}
+
+// A kernel with one implementation per instruction set. Levels without their own
+// implementation (nullptr) fall back to the next lower one.
+template <typename Fn>
+struct simd_kernel {
+    Fn scalar = nullptr;
+    Fn sse2   = nullptr;
+    Fn avx2   = nullptr;
+
+    Fn select() const {
+        auto level = cpu_simd_level();
+        if (level >= simd_level::avx2 && avx2) return avx2;
+        if (level >= simd_level::sse2 && sse2) return sse2;
+        return scalar;
+    }
+};
+
+#endif
@@ -8,11 +8,31 @@
 #include "hittable.h"
 #include "material.h"
 
+inline bool sphere_roots(const point3& center, double radius, const ray& r,
+                         double& root0, double& root1) {
+    // Finds both ray parameters where the ray crosses the sphere, or returns false if it
+    // misses. The quadratic is solved in double even in a float build: for the large
+    // spheres in the scenes, c below cancels away nearly all of a float's precision.
+    vec3d dir(r.direction());
+    vec3d oc = vec3d(r.origin()) - vec3d(center);
+    auto a = dir.length_squared();
+    auto half_b = dot(oc, dir);
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = std::sqrt(discriminant);
+
+    root0 = (-half_b - sqrtd) / a;
+    root1 = (-half_b + sqrtd) / a;
+    return true;
+}
+
 class sphere : public hittable {
   public:
     // Stationary Sphere
     sphere(const point3& center, double radius, shared_ptr<material> mat)
-      : center1(center), radius(radius), mat(mat), is_moving(false)
+      : center1(center), radius(radius), mat(mat), is_moving(false), uv_needed(mat->needs_uv())
     {
         auto rvec = vec3(radius, radius, radius);
         bbox = aabb(center - rvec, center + rvec);
@@ -20,7 +40,7 @@ class sphere : public hittable {
 
     // Moving Sphere
     sphere(const point3& center1, const point3& center2, double radius, shared_ptr<material> mat)
-      : center1(center1), radius(radius), mat(mat), is_moving(true)
+      : center1(center1), radius(radius), mat(mat), is_moving(true), uv_needed(mat->needs_uv())
     {
         auto rvec = vec3(radius, radius, radius);
         aabb box1(center1 - rvec, center1 + rvec);
@@ -33,47 +53,72 @@ class sphere : public hittable {
     aabb bounding_box() const override { return bbox; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        point3 center = is_moving ? center_at(r.time()) : center1;
-        vec3 oc = r.origin() - center;
-        auto a = r.direction().length_squared();
-        auto half_b = dot(oc, r.direction());
-        auto c = oc.length_squared() - radius*radius;
-
-        auto discriminant = half_b*half_b - a*c;
-        if (discriminant < 0) return false;
-        auto sqrtd = sqrt(discriminant);
+        double root0, root1;
+        if (!find_roots(r, root0, root1)) return false;
 
         // Find the nearest root that lies in the acceptable range.
-        auto root = (-half_b - sqrtd) / a;
+        auto root = root0;
         if (!ray_t.surrounds(root)) {
-            root = (-half_b + sqrtd) / a;
+            root = root1;
             if (!ray_t.surrounds(root))
                 return false;
         }
 
         rec.t = root;
+        rec.object = this;
+
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        double root0, root1;
+        if (!find_roots(r, root0, root1)) return false;
+
+        // Either root in range blocks the ray; there is no need to find the nearer one.
+        return ray_t.surrounds(root0) || ray_t.surrounds(root1);
+    }
+
+    bool hit_span(const ray& r, interval ray_t, interval& span) const override {
+        double root0, root1;
+        if (!find_roots(r, root0, root1)) return false;
+
+        // Both crossings come straight from the two roots.
+        bool in0 = ray_t.surrounds(root0);
+        bool in1 = ray_t.surrounds(root1);
+
+        if (!in0 && !in1) return false;
+        span = interval(in0 ? root0 : root1, in1 ? root1 : root0);
+        return true;
+    }
+
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        // Texture coordinates are computed in the sphere's own frame, so a rotated textured
+        // sphere stays an instance.
+        if (uv_needed && to_world.has_rotation())
+            return false;
+
+        auto center_vec_world = is_moving ? to_world.vector(center_vec) : vec3(0,0,0);
+        return compiler.add_sphere(to_world.point(center1), center_vec_world, radius, mat);
+    }
+
+    void compute_surface(const ray& r, hit_record& rec) const override {
+        point3 center = is_moving ? center_at(r.time()) : center1;
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
-        get_sphere_uv(outward_normal, rec.u, rec.v);
+        if (uv_needed) {
+            get_sphere_uv(outward_normal, rec.u, rec.v);
+            rec.uv_scale = uv_scale(radius);
+        }
         rec.mat = mat;
-
-        return true;
     }
 
-  private:
-    point3 center1;
-    double radius;
-    shared_ptr<material> mat;
-    bool is_moving;
-    vec3 center_vec;
-    aabb bbox;
-
-    point3 center_at(double time) const {
-        return center1 + time*center_vec;
+    static real uv_scale(double radius) {
+        // u spans the circumference and v half of it; use the geometric mean of the two rates.
+        return 1 / (std::sqrt(2.0) * pi * radius);
     }
 
-    static void get_sphere_uv(const point3& p, double& u, double& v) {
+    static void get_sphere_uv(const point3& p, real& u, real& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
         // v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -87,6 +132,23 @@ class sphere : public hittable {
         u = phi / (2*pi);
         v = theta / pi;
     }
+
+  private:
+    point3 center1;
+    double radius;
+    shared_ptr<material> mat;
+    bool is_moving;
+    bool uv_needed;  // Whether the material samples a texture by (u,v)
+    vec3 center_vec;
+    aabb bbox;
+
+    point3 center_at(double time) const {
+        return center1 + time*center_vec;
+    }
+
+    bool find_roots(const ray& r, double& root0, double& root1) const {
+        return sphere_roots(is_moving ? center_at(r.time()) : center1, radius, r, root0, root1);
+    }
 };
 
 #endif
\ No newline at end of file
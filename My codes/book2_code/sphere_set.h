@@ -0,0 +1,332 @@
+// This file defines the sphere_set class, a hittable for large numbers of small spheres.
+// The spheres are stored as structure-of-arrays and grouped into leaves of eight nearby
+// spheres, and a ray is tested against all spheres of a leaf at once with SIMD.
+
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "material.h"
+#include "simd.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+class sphere_set : public hittable {
+  public:
+    static const int lanes = 8;  // Spheres per BVH leaf
+
+    // Stationary Sphere
+    void add(const point3& center, double radius, shared_ptr<material> mat) {
+        add(center, center, radius, mat);
+    }
+
+    // Moving Sphere
+    void add(const point3& center1, const point3& center2, double radius, shared_ptr<material> mat) {
+        auto rvec = vec3(radius, radius, radius);
+        aabb box1(center1 - rvec, center1 + rvec);
+        aabb box2(center2 - rvec, center2 + rvec);
+        pending.push_back({center1, center2 - center1, radius, material_id(mat), aabb(box1, box2)});
+        bbox = aabb(bbox, pending.back().bbox);
+    }
+
+    // Sorts the added spheres into leaves and builds the BVH over them. Must be called
+    // after the last add() and before rendering. The leaves point back into this set, so
+    // it must not be copied or moved afterwards (keep it in a shared_ptr).
+    void build() {
+        std::vector<int> order(pending.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<shared_ptr<hittable>> leaves;
+        split(order, 0, order.size(), leaves);
+
+        pending.clear();
+        pending.shrink_to_fit();
+        tree = make_shared<bvh_node>(leaves, 0, leaves.size());
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return tree && tree->hit(r, ray_t, rec);
+    }
+
+    bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+        return tree && tree->occluded(r, ray_t, samples);
+    }
+
+    int size() const { return sphere_count; }
+
+  private:
+    struct sphere_data {
+        point3 center;
+        vec3 center_vec;
+        double radius;
+        int mat_id;
+        aabb bbox;
+    };
+
+    // A BVH leaf: up to eight consecutive spheres of the set.
+    class leaf : public hittable {
+      public:
+        leaf(const sphere_set* set, int first, int count, const aabb& bbox)
+          : set(set), first(first), count(count), bbox(bbox) {}
+
+        aabb bounding_box() const override { return bbox; }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            float t[lanes];
+            set->intersect_leaf(r, ray_t, first, t);
+
+            // Refine the closest hit in double precision. A grazing lane may miss once
+            // refined; then the next closest lane that hit gets its turn.
+            while (true) {
+                int best = -1;
+                for (int i = 0; i < count; i++) {
+                    if (t[i] < ray_t.max && (best < 0 || t[i] < t[best]))
+                        best = i;
+                }
+                if (best < 0) return false;
+
+                double root;
+                if (!set->refine_root(r, ray_t, first + best, root)) {
+                    t[best] = std::numeric_limits<float>::infinity();
+                    continue;
+                }
+
+                rec.t = root;
+                rec.object = this;
+                rec.index = first + best;
+                return true;
+            }
+        }
+
+        bool occluded(const ray& r, interval ray_t, sampler* samples) const override {
+            float t[lanes];
+            set->intersect_leaf(r, ray_t, first, t);
+
+            // Any lane that hit blocks the ray, once refined as hit() refines it, so shadow
+            // rays pass the same grazing spheres camera rays do.
+            double root;
+            for (int i = 0; i < count; i++) {
+                if (t[i] < ray_t.max && set->refine_root(r, ray_t, first + i, root))
+                    return true;
+            }
+            return false;
+        }
+
+        void compute_surface(const ray& r, hit_record& rec) const override {
+            set->leaf_surface(r, rec);
+        }
+
+      private:
+        const sphere_set* set;
+        int first;
+        int count;
+        aabb bbox;
+    };
+
+    using leaf_kernel = void (*)(const sphere_set&, const float*, float, float, int, float*);
+
+    // Structure-of-arrays sphere data, padded to a multiple of the lane count.
+    std::vector<float> cx, cy, cz;  // Center at time 0
+    std::vector<float> vx, vy, vz;  // Center motion per unit time
+    std::vector<float> rr;          // Radius squared
+    std::vector<sphere_data> spheres;  // Full precision copy, for refining the closest hit
+
+    std::vector<shared_ptr<material>> materials;
+    std::vector<bool> uv_needed;    // Per material
+    int sphere_count = 0;
+
+    std::vector<sphere_data> pending;
+    shared_ptr<hittable> tree;
+    aabb bbox;
+    leaf_kernel kernel = select_kernel();
+
+    int material_id(const shared_ptr<material>& mat) {
+        for (size_t i = 0; i < materials.size(); i++) {
+            if (materials[i] == mat) return int(i);
+        }
+        materials.push_back(mat);
+        uv_needed.push_back(mat->needs_uv());
+        return int(materials.size()) - 1;
+    }
+
+    void split(std::vector<int>& order, size_t start, size_t end,
+               std::vector<shared_ptr<hittable>>& leaves) {
+        // Median-split the spheres along the longest axis until a group fits in one leaf,
+        // then append that group to the SoA arrays as one padded leaf.
+        aabb group_box = aabb::empty;
+        for (size_t i = start; i < end; i++)
+            group_box = aabb(group_box, pending[order[i]].bbox);
+
+        if (end - start > size_t(lanes)) {
+            int axis = group_box.longest_axis();
+            auto mid = start + (end - start)/2;
+            std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                [&](int a, int b) {
+                    return pending[a].bbox.axis_interval(axis).min
+                         < pending[b].bbox.axis_interval(axis).min;
+                });
+            split(order, start, mid, leaves);
+            split(order, mid, end, leaves);
+            return;
+        }
+
+        int first = int(cx.size());
+        for (int i = 0; i < lanes; i++) {
+            // Padding lanes get a zero radius; their results are ignored by the leaf.
+            const sphere_data* s = (start + i < end) ? &pending[order[start + i]] : nullptr;
+            cx.push_back(s ? float(s->center.x()) : 0);
+            cy.push_back(s ? float(s->center.y()) : 0);
+            cz.push_back(s ? float(s->center.z()) : 0);
+            vx.push_back(s ? float(s->center_vec.x()) : 0);
+            vy.push_back(s ? float(s->center_vec.y()) : 0);
+            vz.push_back(s ? float(s->center_vec.z()) : 0);
+            rr.push_back(s ? float(s->radius * s->radius) : 0);
+            spheres.push_back(s ? *s : sphere_data{point3(), vec3(), 0, 0, aabb()});
+        }
+        sphere_count += int(end - start);
+        leaves.push_back(make_shared<leaf>(this, first, int(end - start), group_box));
+    }
+
+    void intersect_leaf(const ray& r, interval ray_t, int first, float* t) const {
+        const float ray_data[7] = {
+            float(r.origin().x()), float(r.origin().y()), float(r.origin().z()),
+            float(r.direction().x()), float(r.direction().y()), float(r.direction().z()),
+            float(r.time())
+        };
+        kernel(*this, ray_data, float(ray_t.min), float(ray_t.max), first, t);
+    }
+
+    bool refine_root(const ray& r, interval ray_t, int i, double& root) const {
+        const auto& s = spheres[i];
+        double root0, root1;
+        if (!sphere_roots(s.center + r.time()*s.center_vec, s.radius, r, root0, root1))
+            return false;
+
+        root = ray_t.surrounds(root0) ? root0 : root1;
+        return ray_t.surrounds(root);
+    }
+
+    void leaf_surface(const ray& r, hit_record& rec) const {
+        const auto& sphere = spheres[rec.index];
+        auto center = sphere.center + r.time()*sphere.center_vec;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / sphere.radius;
+        rec.set_face_normal(r, outward_normal);
+        if (uv_needed[sphere.mat_id])
+            sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = materials[sphere.mat_id];
+    }
+
+    // Leaf kernels: write the nearest root within (t_min, t_max) of each of the eight spheres
+    // starting at 'first' into t, or +infinity where a sphere is missed.
+
+    static void leaf_scalar(const sphere_set& s, const float* ray_data, float t_min, float t_max,
+                            int first, float* t) {
+        auto ox = ray_data[0], oy = ray_data[1], oz = ray_data[2];
+        auto dx = ray_data[3], dy = ray_data[4], dz = ray_data[5], time = ray_data[6];
+        auto a = dx*dx + dy*dy + dz*dz;
+
+        for (int i = 0; i < lanes; i++) {
+            int k = first + i;
+            auto ocx = ox - (s.cx[k] + time*s.vx[k]);
+            auto ocy = oy - (s.cy[k] + time*s.vy[k]);
+            auto ocz = oz - (s.cz[k] + time*s.vz[k]);
+            auto half_b = ocx*dx + ocy*dy + ocz*dz;
+            auto c = ocx*ocx + ocy*ocy + ocz*ocz - s.rr[k];
+            auto discriminant = half_b*half_b - a*c;
+
+            t[i] = std::numeric_limits<float>::infinity();
+            if (discriminant < 0) continue;
+            auto sqrtd = std::sqrt(discriminant);
+            auto root0 = (-half_b - sqrtd) / a;
+            auto root1 = (-half_b + sqrtd) / a;
+            if (t_min < root0 && root0 < t_max) t[i] = root0;
+            else if (t_min < root1 && root1 < t_max) t[i] = root1;
+        }
+    }
+
+#ifdef RTW_X86
+    static void leaf_sse2(const sphere_set& s, const float* ray_data, float t_min, float t_max,
+                          int first, float* t) {
+        auto ox = _mm_set1_ps(ray_data[0]), oy = _mm_set1_ps(ray_data[1]), oz = _mm_set1_ps(ray_data[2]);
+        auto dx = _mm_set1_ps(ray_data[3]), dy = _mm_set1_ps(ray_data[4]), dz = _mm_set1_ps(ray_data[5]);
+        auto time = _mm_set1_ps(ray_data[6]);
+        auto a = _mm_set1_ps(ray_data[3]*ray_data[3] + ray_data[4]*ray_data[4] + ray_data[5]*ray_data[5]);
+        auto inv_a = _mm_div_ps(_mm_set1_ps(1), a);
+        auto lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+        auto inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+        for (int i = 0; i < lanes; i += 4) {
+            int k = first + i;
+            auto ocx = _mm_sub_ps(ox, _mm_add_ps(_mm_loadu_ps(&s.cx[k]), _mm_mul_ps(time, _mm_loadu_ps(&s.vx[k]))));
+            auto ocy = _mm_sub_ps(oy, _mm_add_ps(_mm_loadu_ps(&s.cy[k]), _mm_mul_ps(time, _mm_loadu_ps(&s.vy[k]))));
+            auto ocz = _mm_sub_ps(oz, _mm_add_ps(_mm_loadu_ps(&s.cz[k]), _mm_mul_ps(time, _mm_loadu_ps(&s.vz[k]))));
+            auto half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+            auto c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+                                           _mm_mul_ps(ocz, ocz)),
+                                _mm_loadu_ps(&s.rr[k]));
+            auto discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+            auto has_roots = _mm_cmpge_ps(discriminant, _mm_setzero_ps());
+            auto sqrtd = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+            auto neg_b = _mm_sub_ps(_mm_setzero_ps(), half_b);
+            auto root0 = _mm_mul_ps(_mm_sub_ps(neg_b, sqrtd), inv_a);
+            auto root1 = _mm_mul_ps(_mm_add_ps(neg_b, sqrtd), inv_a);
+            auto in0 = _mm_and_ps(_mm_cmplt_ps(lo, root0), _mm_cmplt_ps(root0, hi));
+            auto in1 = _mm_and_ps(_mm_cmplt_ps(lo, root1), _mm_cmplt_ps(root1, hi));
+            auto root = _mm_or_ps(_mm_and_ps(in0, root0), _mm_andnot_ps(in0, root1));
+            auto valid = _mm_and_ps(has_roots, _mm_or_ps(in0, in1));
+            _mm_storeu_ps(t + i, _mm_or_ps(_mm_and_ps(valid, root), _mm_andnot_ps(valid, inf)));
+        }
+    }
+
+    RTW_TARGET_AVX2
+    static void leaf_avx2(const sphere_set& s, const float* ray_data, float t_min, float t_max,
+                          int first, float* t) {
+        auto ox = _mm256_set1_ps(ray_data[0]), oy = _mm256_set1_ps(ray_data[1]), oz = _mm256_set1_ps(ray_data[2]);
+        auto dx = _mm256_set1_ps(ray_data[3]), dy = _mm256_set1_ps(ray_data[4]), dz = _mm256_set1_ps(ray_data[5]);
+        auto time = _mm256_set1_ps(ray_data[6]);
+        auto a = _mm256_set1_ps(ray_data[3]*ray_data[3] + ray_data[4]*ray_data[4] + ray_data[5]*ray_data[5]);
+        auto inv_a = _mm256_div_ps(_mm256_set1_ps(1), a);
+        auto lo = _mm256_set1_ps(t_min), hi = _mm256_set1_ps(t_max);
+        auto zero = _mm256_setzero_ps();
+
+        int k = first;
+        auto ocx = _mm256_sub_ps(ox, _mm256_fmadd_ps(time, _mm256_loadu_ps(&s.vx[k]), _mm256_loadu_ps(&s.cx[k])));
+        auto ocy = _mm256_sub_ps(oy, _mm256_fmadd_ps(time, _mm256_loadu_ps(&s.vy[k]), _mm256_loadu_ps(&s.cy[k])));
+        auto ocz = _mm256_sub_ps(oz, _mm256_fmadd_ps(time, _mm256_loadu_ps(&s.vz[k]), _mm256_loadu_ps(&s.cz[k])));
+        auto half_b = _mm256_fmadd_ps(ocz, dz, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocx, dx)));
+        auto c = _mm256_sub_ps(_mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))),
+                               _mm256_loadu_ps(&s.rr[k]));
+        auto discriminant = _mm256_fmsub_ps(half_b, half_b, _mm256_mul_ps(a, c));
+        auto has_roots = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+        auto sqrtd = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+        auto neg_b = _mm256_sub_ps(zero, half_b);
+        auto root0 = _mm256_mul_ps(_mm256_sub_ps(neg_b, sqrtd), inv_a);
+        auto root1 = _mm256_mul_ps(_mm256_add_ps(neg_b, sqrtd), inv_a);
+        auto in0 = _mm256_and_ps(_mm256_cmp_ps(lo, root0, _CMP_LT_OQ), _mm256_cmp_ps(root0, hi, _CMP_LT_OQ));
+        auto in1 = _mm256_and_ps(_mm256_cmp_ps(lo, root1, _CMP_LT_OQ), _mm256_cmp_ps(root1, hi, _CMP_LT_OQ));
+        auto root = _mm256_blendv_ps(root1, root0, in0);
+        auto valid = _mm256_and_ps(has_roots, _mm256_or_ps(in0, in1));
+        auto inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+        _mm256_storeu_ps(t, _mm256_blendv_ps(inf, root, valid));
+    }
+#endif
+
+    static leaf_kernel select_kernel() {
+        simd_kernel<leaf_kernel> kernels;
+        kernels.scalar = leaf_scalar;
+#ifdef RTW_X86
+        kernels.sse2 = leaf_sse2;
+        kernels.avx2 = leaf_avx2;
+#endif
+        return kernels.select();
+    }
+};
+
+#endif
@@ -2,14 +2,47 @@
 #define TEXTURE_H
 
 #include "rtweekend.h"
+#include "mipmap.h"
 #include "perlin.h"
 #include "rtw_stb_image.h"
+#include "texture_registry.h"
+
+#include <algorithm>
+#include <cstring>
+
+class texture;
+
+// Receives a texture tree as it is lowered into a flat program (see texture_program.h).
+class texture_compiler {
+  public:
+    virtual ~texture_compiler() = default;
+
+    virtual void add_constant(const color& value) = 0;
+
+    // Selects between two textures by the parity of the cell of p on a grid of cells 1/inv_scale wide.
+    virtual void add_checker(double inv_scale, const texture& even, const texture& odd) = 0;
+
+    // Any other texture, evaluated through its value() function.
+    virtual void add_texture(const texture& tex) = 0;
+};
 
 class texture {
   public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // Like value(), for a lookup that covers a width of footprint in (u,v). Filtered textures
+    // use it to pick their level of detail; others ignore it.
+    virtual color filtered_value(double u, double v, const point3& p, double footprint) const {
+        return value(u, v, p);
+    }
+
+    // Whether value() depends on the (u,v) texture coordinates, or only on the point p.
+    virtual bool needs_uv() const { return false; }
+
+    // Lowers this texture into the compiler's program.
+    virtual void compile(texture_compiler& compiler) const { compiler.add_texture(*this); }
 };
 
 class solid_color : public texture {
@@ -22,6 +55,8 @@ class solid_color : public texture {
         return albedo;
     }
 
+    void compile(texture_compiler& compiler) const override { compiler.add_constant(albedo); }
+
   private:
     color albedo;
 };
@@ -35,13 +70,21 @@ class checker_texture : public texture {
       : checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
 
     color value(double u, double v, const point3& p) const override {
+        return is_even(inv_scale, p) ? even->value(u, v, p) : odd->value(u, v, p);
+    }
+
+    bool needs_uv() const override { return even->needs_uv() || odd->needs_uv(); }
+
+    void compile(texture_compiler& compiler) const override {
+        compiler.add_checker(inv_scale, *even, *odd);
+    }
+
+    static bool is_even(double inv_scale, const point3& p) {
         auto xInteger = int(std::floor(inv_scale * p.x()));
         auto yInteger = int(std::floor(inv_scale * p.y()));
         auto zInteger = int(std::floor(inv_scale * p.z()));
 
-        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
-
-        return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+        return (xInteger + yInteger + zInteger) % 2 == 0;
     }
 
   private:
@@ -50,28 +93,90 @@ class checker_texture : public texture {
     shared_ptr<texture> odd;
 };
 
+enum class texture_filter {
+    nearest,    // The single texel under (u,v)
+    bilinear,   // Blend of the four nearest texels of the full image
+    trilinear   // Bilinear on the two mipmap levels nearest the lookup's footprint
+};
+
 class image_texture : public texture {
   public:
-    image_texture(const char* filename) : image(filename) {}
+    image_texture(const char* filename) : image_texture(filename, default_format()) {}
+
+    // A tiled texture keeps its mipmap in a tile file and pages it through the shared
+    // tile_cache instead of loading it whole (see tile_cache.h). Textures of the same file
+    // share its texels, which are decoded on first use (see texture_registry.h).
+    image_texture(const char* filename, texel_format format, bool tiled = default_tiled())
+      : source(texture_registry::global().find(filename, format, tiled))
+    {
+        // Set RTW_TEXTURE_FILTER to compare filters without editing the scenes.
+        if (auto name = std::getenv("RTW_TEXTURE_FILTER")) {
+            if (std::strcmp(name, "nearest") == 0) filter = texture_filter::nearest;
+            if (std::strcmp(name, "bilinear") == 0) filter = texture_filter::bilinear;
+        }
+    }
+
+    // The storage format for textures that don't name one: srgb8, unless RTW_TEXTURE_FORMAT
+    // picks half or bc1.
+    static texel_format default_format() {
+        if (auto name = std::getenv("RTW_TEXTURE_FORMAT")) {
+            if (std::strcmp(name, "half") == 0) return texel_format::half;
+            if (std::strcmp(name, "bc1") == 0) return texel_format::bc1;
+        }
+        return texel_format::srgb8;
+    }
+
+    // Whether textures are tiled unless they say otherwise: RTW_TILED_TEXTURES=1 turns it on.
+    static bool default_tiled() {
+        auto setting = std::getenv("RTW_TILED_TEXTURES");
+        return setting && std::strcmp(setting, "1") == 0;
+    }
+
+    // The memory the texels take; for tiled textures, see the tile_cache instead.
+    size_t size_in_bytes() const {
+        source->load();
+        return source->mips().size_in_bytes();
+    }
 
     color value(double u, double v, const point3& p) const override {
+        return filtered_value(u, v, p, 0);
+    }
+
+    color filtered_value(double u, double v, const point3& p, double footprint) const override {
+        source->load();
+        if (auto tiles = source->tiles())
+            return lookup(*tiles, u, v, footprint);
+        return lookup(source->mips(), u, v, footprint);
+    }
+
+    bool needs_uv() const override { return true; }
+
+    texture_filter filter = texture_filter::trilinear;
+
+  private:
+    shared_ptr<image_source> source;
+
+    template <typename Pyramid>
+    color lookup(const Pyramid& pyramid, double u, double v, double footprint) const {
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0,1,1);
+        if (pyramid.level_count() == 0) return color(0,1,1);
 
         // Clamp input texture coordinates to [0,1] x [1,0]
         u = interval(0,1).clamp(u);
         v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i,j);
+        if (filter == texture_filter::nearest)
+            return pyramid.nearest(u, v);
 
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
-    }
+        // The level of detail is the number of halvings until one texel covers the footprint.
+        auto lod = 0.0;
+        if (filter == texture_filter::trilinear && footprint > 0) {
+            auto size = std::max(pyramid.level_width(0), pyramid.level_height(0));
+            lod = std::log2(footprint * size);
+        }
 
-  private:
-    rtw_image image;
+        return pyramid.trilinear(u, v, lod);
+    }
 };
 
 class noise_texture : public texture {
@@ -0,0 +1,141 @@
+// This file defines texture_program, a texture tree lowered into a flat array of
+// instructions. Nested textures such as a checker of solid colors become a short program
+// evaluated by a small interpreter, instead of a chain of virtual value() calls. Solid
+// colors are folded into the instructions that use them, and a checker whose two sides
+// come out the same folds to a constant.
+
+#ifndef TEXTURE_PROGRAM_H
+#define TEXTURE_PROGRAM_H
+
+#include "texture.h"
+
+#include <vector>
+
+// One texture lookup, for the batched texture_program::value().
+struct texture_query {
+    double u, v;
+    point3 p;
+    double footprint = 0;  // See texture::filtered_value()
+};
+
+class texture_program : public texture_compiler {
+  public:
+    texture_program() {}
+
+    explicit texture_program(const texture& root) { root.compile(*this); }
+
+    // Returns true, with the color in value, if the program always gives the same color.
+    bool is_constant(color& value) const {
+        if (code.size() != 1 || code[0].op != opcode::constant)
+            return false;
+        value = code[0].even;
+        return true;
+    }
+
+    int size() const { return int(code.size()); }
+
+    color value(double u, double v, const point3& p, double footprint = 0) const {
+        int pc = 0;
+        while (true) {
+            const auto& in = code[pc];
+            switch (in.op) {
+                case opcode::constant:
+                    return in.even;
+                case opcode::checker_constant:
+                    return checker_texture::is_even(in.inv_scale, p) ? in.even : in.odd;
+                case opcode::checker:
+                    pc += checker_texture::is_even(in.inv_scale, p) ? 1 : in.odd_offset;
+                    break;
+                case opcode::call:
+                    return in.tex->filtered_value(u, v, p, footprint);
+            }
+        }
+    }
+
+    // Evaluates count lookups at once. Constant and single checker programs take loops of
+    // their own, without going through the interpreter.
+    void value(const texture_query* queries, color* results, int count) const {
+        const auto& first = code[0];
+
+        if (first.op == opcode::constant) {
+            for (int i = 0; i < count; i++)
+                results[i] = first.even;
+        } else if (first.op == opcode::checker_constant) {
+            for (int i = 0; i < count; i++) {
+                bool even = checker_texture::is_even(first.inv_scale, queries[i].p);
+                results[i] = even ? first.even : first.odd;
+            }
+        } else {
+            for (int i = 0; i < count; i++)
+                results[i] = value(queries[i].u, queries[i].v, queries[i].p, queries[i].footprint);
+        }
+    }
+
+    // Compiler interface, called by texture::compile().
+
+    void add_constant(const color& value) override {
+        instruction in;
+        in.op = opcode::constant;
+        in.even = value;
+        code.push_back(in);
+    }
+
+    void add_checker(double inv_scale, const texture& even, const texture& odd) override {
+        texture_program even_program(even);
+        texture_program odd_program(odd);
+
+        color even_color, odd_color;
+        if (even_program.is_constant(even_color) && odd_program.is_constant(odd_color)) {
+            if (even_color[0] == odd_color[0] && even_color[1] == odd_color[1]
+                && even_color[2] == odd_color[2]) {
+                add_constant(even_color);
+                return;
+            }
+
+            instruction in;
+            in.op = opcode::checker_constant;
+            in.inv_scale = inv_scale;
+            in.even = even_color;
+            in.odd = odd_color;
+            code.push_back(in);
+            return;
+        }
+
+        // The even program follows the checker directly and the odd program follows it.
+        // Jumps are relative, so the subprograms can be appended as they are.
+        instruction in;
+        in.op = opcode::checker;
+        in.inv_scale = inv_scale;
+        in.odd_offset = 1 + even_program.size();
+        code.push_back(in);
+        code.insert(code.end(), even_program.code.begin(), even_program.code.end());
+        code.insert(code.end(), odd_program.code.begin(), odd_program.code.end());
+    }
+
+    void add_texture(const texture& tex) override {
+        instruction in;
+        in.op = opcode::call;
+        in.tex = &tex;
+        code.push_back(in);
+    }
+
+  private:
+    enum class opcode : unsigned char {
+        constant,          // Returns even
+        checker_constant,  // Returns even or odd by the checker parity
+        checker,           // Continues with the next instruction or jumps odd_offset ahead
+        call               // Returns tex->filtered_value()
+    };
+
+    struct instruction {
+        opcode op = opcode::constant;
+        int odd_offset = 0;
+        double inv_scale = 0;
+        color even, odd;
+        const texture* tex = nullptr;
+    };
+
+    std::vector<instruction> code;
+};
+
+#endif
@@ -0,0 +1,158 @@
+// This file defines texture_registry, which shares decoded images between image textures.
+// Textures that name the same file (after resolving where it is found) in the same storage
+// format get the same image_source, so each file is decoded once. Decoding is deferred:
+// a source decodes on its first lookup, or earlier when load_all() decodes every pending
+// source in parallel before rendering starts.
+
+#ifndef TEXTURE_REGISTRY_H
+#define TEXTURE_REGISTRY_H
+
+#include "rtweekend.h"
+#include "mipmap.h"
+#include "rtw_stb_image.h"
+#include "texture_storage.h"
+#include "tile_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// The texels of one image file in one format: a mipmap, or a tiled_mipmap for tiled textures.
+class image_source {
+  public:
+    image_source(const std::string& path, texel_format format, bool tiled)
+      : file_path(path), format(format), is_tiled(tiled) {}
+
+    image_source(const image_source&) = delete;
+    image_source& operator=(const image_source&) = delete;
+
+    // Decodes the image if that hasn't happened yet. Safe to call from several threads; the
+    // others wait for the first one to finish.
+    void load() {
+        if (ready.load(std::memory_order_acquire)) return;
+        std::call_once(once, [this] {
+            decode();
+            ready.store(true, std::memory_order_release);
+        });
+    }
+
+    bool loaded() const { return ready.load(std::memory_order_acquire); }
+
+    const std::string& path() const { return file_path; }
+
+    // The image's texels, once load() has returned. tiles() is null unless the source is tiled.
+    const mipmap& mips() const { return pyramid; }
+    const tiled_mipmap* tiles() const { return tiled.get(); }
+
+  private:
+    std::string file_path;
+    texel_format format;
+    bool is_tiled;
+    std::once_flag once;
+    std::atomic<bool> ready{false};
+    mipmap pyramid;
+    std::unique_ptr<tiled_mipmap> tiled;
+
+    void decode() {
+        // Build the report first so lines from parallel loads don't interleave.
+        std::ostringstream report;
+
+        if (is_tiled) {
+            tiled = std::make_unique<tiled_mipmap>(file_path.c_str(), format);
+            if (tiled->level_count() > 0) {
+                report << "Texture " << file_path << ": " << tiled->level_width(0) << 'x'
+                       << tiled->level_height(0) << ' ' << texel_format_name(format)
+                       << ", tiled, " << tiled->file_size() / 1024 << " KiB file\n";
+            }
+        } else {
+            pyramid = mipmap(rtw_image(file_path.c_str()), format);
+            if (pyramid.level_count() > 0) {
+                report << "Texture " << file_path << ": " << pyramid.level_width(0) << 'x'
+                       << pyramid.level_height(0) << ' ' << texel_format_name(format) << ", "
+                       << pyramid.size_in_bytes() / 1024 << " KiB with mipmaps\n";
+            }
+        }
+
+        std::clog << report.str();
+    }
+};
+
+class texture_registry {
+  public:
+    texture_registry() {}
+    texture_registry(const texture_registry&) = delete;
+    texture_registry& operator=(const texture_registry&) = delete;
+
+    // The registry image textures use.
+    static texture_registry& global() {
+        static texture_registry registry;
+        return registry;
+    }
+
+    // Returns the source of image_filename in format, shared with every other texture that
+    // asked for the same file and format while it is in use. The image isn't decoded yet.
+    shared_ptr<image_source> find(const char* image_filename, texel_format format, bool tiled) {
+        key k{rtw_image::resolve(image_filename), format, tiled};
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& entry = sources[k];
+        if (auto source = entry.lock())
+            return source;
+
+        auto source = make_shared<image_source>(std::get<0>(k), format, tiled);
+        entry = source;
+        return source;
+    }
+
+    // Decodes every source in use that isn't loaded yet, on up to thread_count threads.
+    void load_all(unsigned thread_count = std::thread::hardware_concurrency()) {
+        std::vector<shared_ptr<image_source>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = sources.begin(); it != sources.end();) {
+                auto source = it->second.lock();
+                if (!source) {
+                    it = sources.erase(it);  // Every texture using it is gone
+                    continue;
+                }
+                if (!source->loaded()) pending.push_back(source);
+                ++it;
+            }
+        }
+
+        thread_count = std::max(1u, std::min(thread_count, unsigned(pending.size())));
+        if (pending.size() <= 1 || thread_count == 1) {
+            for (auto& source : pending)
+                source->load();
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        auto work = [&] {
+            for (size_t i = next++; i < pending.size(); i = next++)
+                pending[i]->load();
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < thread_count; i++)
+            workers.emplace_back(work);
+        work();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+  private:
+    using key = std::tuple<std::string, texel_format, bool>;  // Resolved path, format, tiled
+
+    std::mutex mutex;
+    std::map<key, std::weak_ptr<image_source>> sources;
+};
+
+#endif
@@ -0,0 +1,273 @@
+// This file defines texture_storage, the texels of one image kept in a single compact
+// format. Images are decoded to linear floats when they load and then encoded into one of
+// these formats; texel() decodes a single texel back to a linear color when sampled.
+
+#ifndef TEXTURE_STORAGE_H
+#define TEXTURE_STORAGE_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+enum class texel_format {
+    srgb8,  // 8 bits per channel, sRGB encoded: 3 bytes per texel
+    half,   // 16-bit float per channel, keeps HDR values: 6 bytes per texel
+    bc1     // BC1 (DXT1) blocks of 4x4 sRGB texels: half a byte per texel, lossy
+};
+
+inline const char* texel_format_name(texel_format format) {
+    switch (format) {
+        case texel_format::srgb8: return "srgb8";
+        case texel_format::half:  return "half";
+        case texel_format::bc1:   return "bc1";
+    }
+    return "";
+}
+
+class texture_storage {
+  public:
+    texture_storage() {}
+
+    // Encodes width x height linear RGB float texels, stored by rows.
+    texture_storage(const float* rgb, int width, int height, texel_format format)
+      : image_width(width), image_height(height), texels_format(format)
+    {
+        switch (format) {
+            case texel_format::srgb8: encode_srgb8(rgb); break;
+            case texel_format::half:  encode_half(rgb);  break;
+            case texel_format::bc1:   encode_bc1(rgb);   break;
+        }
+    }
+
+    // Wraps texels already encoded in format, e.g. read back from a file written from bytes().
+    static texture_storage from_bytes(
+        const unsigned char* bytes, int width, int height, texel_format format
+    ) {
+        texture_storage storage;
+        storage.image_width = width;
+        storage.image_height = height;
+        storage.texels_format = format;
+        storage.data.assign(bytes, bytes + encoded_size(width, height, format));
+        return storage;
+    }
+
+    // The number of bytes width x height texels take in format.
+    static size_t encoded_size(int width, int height, texel_format format) {
+        switch (format) {
+            case texel_format::srgb8: return 3 * size_t(width) * height;
+            case texel_format::half:  return 6 * size_t(width) * height;
+            case texel_format::bc1:   return 8 * size_t((width + 3) / 4) * ((height + 3) / 4);
+        }
+        return 0;
+    }
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+    texel_format format() const { return texels_format; }
+    size_t size_in_bytes() const { return data.size(); }
+    const unsigned char* bytes() const { return data.data(); }
+
+    // Returns the linear color of the texel at (x,y), which must be inside the image.
+    color texel(int x, int y) const {
+        switch (texels_format) {
+            case texel_format::srgb8: {
+                auto p = &data[3 * (size_t(y)*image_width + x)];
+                return color(srgb_table()[p[0]], srgb_table()[p[1]], srgb_table()[p[2]]);
+            }
+            case texel_format::half: {
+                uint16_t h[3];
+                std::memcpy(h, &data[6 * (size_t(y)*image_width + x)], sizeof h);
+                return color(half_to_float(h[0]), half_to_float(h[1]), half_to_float(h[2]));
+            }
+            case texel_format::bc1:
+                return bc1_texel(x, y);
+        }
+        return color(0,0,0);
+    }
+
+  private:
+    int image_width = 0;
+    int image_height = 0;
+    texel_format texels_format = texel_format::srgb8;
+    std::vector<unsigned char> data;
+
+    // sRGB
+
+    static unsigned char linear_to_srgb8(float value) {
+        if (value <= 0) return 0;
+        if (value >= 1) return 255;
+        auto s = value <= 0.0031308f ? 12.92f * value : 1.055f * std::pow(value, 1/2.4f) - 0.055f;
+        return static_cast<unsigned char>(s * 255 + 0.5f);
+    }
+
+    static const float* srgb_table() {
+        // Linear values of the 256 sRGB codes.
+        static const auto table = [] {
+            std::vector<float> t(256);
+            for (int i = 0; i < 256; i++) {
+                auto s = i / 255.0f;
+                t[i] = s <= 0.04045f ? s / 12.92f : std::pow((s + 0.055f) / 1.055f, 2.4f);
+            }
+            return t;
+        }();
+        return table.data();
+    }
+
+    void encode_srgb8(const float* rgb) {
+        data.resize(encoded_size(image_width, image_height, texel_format::srgb8));
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = linear_to_srgb8(rgb[i]);
+    }
+
+    // Half float
+
+    static uint16_t float_to_half(float value) {
+        uint32_t f;
+        std::memcpy(&f, &value, sizeof f);
+
+        uint16_t sign = (f >> 16) & 0x8000;
+        int exponent = int((f >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = f & 0x7fffff;
+
+        if (((f >> 23) & 0xff) == 0xff)  // Infinity or NaN
+            return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        if (exponent >= 31)  // Too large: infinity
+            return sign | 0x7c00;
+        if (exponent <= 0) {  // Subnormal half, or zero
+            if (exponent < -10) return sign;
+            mantissa |= 0x800000;
+            auto rounding = (mantissa >> (13 - exponent)) & 1;
+            return sign | uint16_t((mantissa >> (14 - exponent)) + rounding);
+        }
+
+        // Round to nearest; a carry out of the mantissa correctly bumps the exponent.
+        return uint16_t(sign | ((exponent << 10) + (mantissa >> 13) + ((mantissa >> 12) & 1)));
+    }
+
+    static float half_to_float(uint16_t h) {
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        uint32_t f;
+
+        if (exponent == 0) {
+            if (mantissa == 0) {
+                f = sign;
+            } else {  // Subnormal: normalize it
+                exponent = 127 - 15 + 1;
+                while (!(mantissa & 0x400)) { mantissa <<= 1; exponent--; }
+                f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+            }
+        } else if (exponent == 31) {
+            f = sign | 0x7f800000 | (mantissa << 13);
+        } else {
+            f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+
+        float value;
+        std::memcpy(&value, &f, sizeof value);
+        return value;
+    }
+
+    void encode_half(const float* rgb) {
+        size_t count = 3 * size_t(image_width) * image_height;
+        data.resize(encoded_size(image_width, image_height, texel_format::half));
+        for (size_t i = 0; i < count; i++) {
+            auto h = float_to_half(rgb[i]);
+            std::memcpy(&data[2*i], &h, sizeof h);
+        }
+    }
+
+    // BC1: each 4x4 block is two RGB565 endpoint colors followed by 16 2-bit indices into a
+    // palette of the endpoints and two colors between them. Endpoints are in sRGB space.
+
+    int blocks_wide() const { return (image_width + 3) / 4; }
+
+    static uint16_t pack565(const int c[3]) {
+        return uint16_t(((c[0] * 31 + 127) / 255) << 11 | ((c[1] * 63 + 127) / 255) << 5
+                        | ((c[2] * 31 + 127) / 255));
+    }
+
+    static void unpack565(uint16_t v, int c[3]) {
+        c[0] = ((v >> 11) & 31) * 255 / 31;
+        c[1] = ((v >> 5) & 63) * 255 / 63;
+        c[2] = (v & 31) * 255 / 31;
+    }
+
+    static void bc1_palette(uint16_t c0, uint16_t c1, int palette[4][3]) {
+        unpack565(c0, palette[0]);
+        unpack565(c1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+        }
+    }
+
+    void encode_bc1(const float* rgb) {
+        int blocks_high = (image_height + 3) / 4;
+        data.resize(encoded_size(image_width, image_height, texel_format::bc1));
+
+        for (int by = 0; by < blocks_high; by++) {
+            for (int bx = 0; bx < blocks_wide(); bx++) {
+                // Gather the block in sRGB, repeating edge texels past the image border.
+                int block[16][3];
+                int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(4*bx + i % 4, image_width - 1);
+                    int y = std::min(4*by + i / 4, image_height - 1);
+                    for (int c = 0; c < 3; c++) {
+                        block[i][c] = linear_to_srgb8(rgb[3 * (size_t(y)*image_width + x) + c]);
+                        lo[c] = std::min(lo[c], block[i][c]);
+                        hi[c] = std::max(hi[c], block[i][c]);
+                    }
+                }
+
+                // Endpoints at the corners of the block's bounding box. The four color mode
+                // needs c0 > c1; when they are equal every texel uses c0.
+                uint16_t c0 = pack565(hi), c1 = pack565(lo);
+                if (c0 < c1) std::swap(c0, c1);
+
+                int palette[4][3];
+                bc1_palette(c0, c1, palette);
+
+                uint32_t indices = 0;
+                for (int i = 0; i < 16; i++) {
+                    int best = 0, best_distance = 1 << 30;
+                    for (int k = 0; k < (c0 == c1 ? 1 : 4); k++) {
+                        int distance = 0;
+                        for (int c = 0; c < 3; c++) {
+                            int d = block[i][c] - palette[k][c];
+                            distance += d*d;
+                        }
+                        if (distance < best_distance) { best = k; best_distance = distance; }
+                    }
+                    indices |= uint32_t(best) << (2*i);
+                }
+
+                auto out = &data[8 * (size_t(by)*blocks_wide() + bx)];
+                std::memcpy(out, &c0, 2);
+                std::memcpy(out + 2, &c1, 2);
+                std::memcpy(out + 4, &indices, 4);
+            }
+        }
+    }
+
+    color bc1_texel(int x, int y) const {
+        auto block = &data[8 * (size_t(y/4)*blocks_wide() + x/4)];
+        uint16_t c0, c1;
+        uint32_t indices;
+        std::memcpy(&c0, block, 2);
+        std::memcpy(&c1, block + 2, 2);
+        std::memcpy(&indices, block + 4, 4);
+
+        int palette[4][3];
+        bc1_palette(c0, c1, palette);
+        auto entry = palette[(indices >> (2 * (4*(y%4) + x%4))) & 3];
+        return color(srgb_table()[entry[0]], srgb_table()[entry[1]], srgb_table()[entry[2]]);
+    }
+};
+
+#endif
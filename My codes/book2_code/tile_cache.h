@@ -0,0 +1,439 @@
+// This file defines a tiled, memory-mapped form of image textures. An image is converted
+// once into a tile file holding its mipmap levels cut into square tiles in a texel_format.
+// The file is memory-mapped, and tiles are copied into a tile_cache on first use. The cache
+// is shared by all tiled textures and threads, holds at most a byte budget of tiles, and
+// evicts the least recently used ones when it is full. Lookups of resident tiles take no
+// locks.
+
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include "rtweekend.h"
+#include "mipmap.h"
+#include "rtw_stb_image.h"
+#include "texture_storage.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// A read-only view of a whole file, memory-mapped where the platform allows.
+class mapped_file {
+  public:
+    mapped_file() {}
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() { close(); }
+
+    void close() {
+#ifndef _WIN32
+        if (mapping) munmap(mapping, file_size);
+        mapping = nullptr;
+#else
+        contents.clear();
+#endif
+        file_size = 0;
+    }
+
+    bool open(const std::string& filename) {
+        close();
+#ifdef _WIN32
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) return false;
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        file_size = contents.size();
+        return true;
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+
+        file_size = size_t(info.st_size);
+        void* p = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);  // The mapping stays valid after the descriptor is closed.
+        if (p == MAP_FAILED) return false;
+
+        mapping = p;
+        return true;
+#endif
+    }
+
+    const unsigned char* data() const {
+#ifdef _WIN32
+        return reinterpret_cast<const unsigned char*>(contents.data());
+#else
+        return static_cast<const unsigned char*>(mapping);
+#endif
+    }
+
+    size_t size() const { return file_size; }
+
+  private:
+    size_t file_size = 0;
+#ifdef _WIN32
+    std::vector<char> contents;
+#else
+    void* mapping = nullptr;
+#endif
+};
+
+class tile_cache {
+  public:
+    struct slot;
+
+    // Where a texture records which slot holds one of its tiles; null when not resident.
+    using tile_entry = std::atomic<slot*>;
+
+    struct slot {
+        std::atomic<int> pins{0};          // Readers currently using tile
+        std::atomic<bool> referenced{false};  // Used since the clock hand last passed
+        tile_entry* owner = nullptr;       // Entry pointing at this slot; null if free
+        texture_storage tile;
+    };
+
+    explicit tile_cache(size_t budget_bytes) : budget(budget_bytes) {}
+
+    tile_cache(const tile_cache&) = delete;
+    tile_cache& operator=(const tile_cache&) = delete;
+
+    // The cache shared by all tiled textures. RTW_TILE_CACHE_MB sets its budget (default 64).
+    static tile_cache& global() {
+        static tile_cache cache([] {
+            auto megabytes = std::getenv("RTW_TILE_CACHE_MB");
+            return size_t(megabytes ? std::atoi(megabytes) : 64) << 20;
+        }());
+        return cache;
+    }
+
+    // Calls read(tile) with the tile recorded by entry, calling load() to get it first if it
+    // isn't resident. The tile stays resident until read returns.
+    template <typename Load, typename Read>
+    void access(tile_entry& entry, const Load& load, const Read& read) {
+        while (true) {
+            slot* s = entry.load();
+            if (s != nullptr) {
+                // Pin the slot, then check it still holds this tile: an eviction unhooks the
+                // entry before waiting for pins to drop, so one of the two sees the other.
+                s->pins.fetch_add(1);
+                if (entry.load() == s) {
+                    if (!s->referenced.load(std::memory_order_relaxed))
+                        s->referenced.store(true, std::memory_order_relaxed);
+                    read(s->tile);
+                    s->pins.fetch_sub(1, std::memory_order_release);
+                    return;
+                }
+                s->pins.fetch_sub(1, std::memory_order_release);
+            }
+
+            page_in(entry, load);
+        }
+    }
+
+    // Drops the tiles of entries, which are about to go away.
+    void release(tile_entry* entries, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < count; i++) {
+            if (slot* s = entries[i].load())
+                free_slot(s);
+        }
+    }
+
+    size_t budget_bytes() const { return budget; }
+    size_t resident_bytes() const { return used.load(std::memory_order_relaxed); }
+    uint64_t tile_loads() const { return loads.load(std::memory_order_relaxed); }
+
+  private:
+    size_t budget;
+    std::mutex mutex;                // Held while paging tiles in and out
+    std::deque<slot> slots;          // Never shrinks, so slot pointers stay valid
+    std::vector<slot*> free_slots;
+    size_t clock_hand = 0;
+    std::atomic<size_t> used{0};
+    std::atomic<uint64_t> loads{0};
+
+    template <typename Load>
+    void page_in(tile_entry& entry, const Load& load) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entry.load() != nullptr) return;  // Another thread loaded it meanwhile
+
+        texture_storage tile = load();
+        auto size = tile.size_in_bytes();
+
+        while (used + size > budget && evict_one()) {}
+
+        slot* s;
+        if (!free_slots.empty()) {
+            s = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slots.emplace_back();
+            s = &slots.back();
+        }
+
+        s->tile = std::move(tile);
+        s->owner = &entry;
+        s->referenced.store(true, std::memory_order_relaxed);
+        used += size;
+        loads.fetch_add(1, std::memory_order_relaxed);
+        entry.store(s);
+    }
+
+    bool evict_one() {
+        // CLOCK approximation of least recently used: sweep the slots, giving referenced
+        // ones a second chance, and evict the first one that wasn't used since the last pass.
+        if (slots.empty()) return false;
+
+        for (size_t step = 0; step < 2 * slots.size(); step++) {
+            slot& s = slots[clock_hand];
+            clock_hand = (clock_hand + 1) % slots.size();
+
+            if (s.owner == nullptr || s.pins.load() != 0) continue;
+            if (s.referenced.exchange(false, std::memory_order_relaxed)) continue;
+
+            free_slot(&s);
+            return true;
+        }
+        return false;
+    }
+
+    void free_slot(slot* s) {
+        s->owner->store(nullptr);
+        while (s->pins.load() != 0)  // Let readers that pinned it before the unhook finish
+            std::this_thread::yield();
+
+        used -= s->tile.size_in_bytes();
+        s->tile = texture_storage();
+        s->owner = nullptr;
+        free_slots.push_back(s);
+    }
+};
+
+// An image texture's mipmap, kept in a tile file and paged through a tile_cache.
+class tiled_mipmap : public mip_filtering<tiled_mipmap> {
+  public:
+    static const int tile_size = 32;  // Texels along each side of a tile
+
+    // Maps the tile file for image_filename in format, writing it first if it doesn't exist
+    // or was made from an older version of the image. Tile files go to RTW_TILE_DIR, or the
+    // current directory.
+    tiled_mipmap(const char* image_filename, texel_format format,
+                 tile_cache& cache = tile_cache::global())
+      : format(format), cache(cache)
+    {
+        auto source = rtw_image::resolve(image_filename);
+        auto path = tile_path(source, format);
+        auto stamp = source_stamp(source);
+        if (!read_header(path, stamp)) {
+            file.close();  // Don't keep a stale file mapped while it is rewritten
+            convert(source, path, stamp);
+            if (!read_header(path, stamp)) {
+                std::cerr << "ERROR: Could not write tile file '" << path << "'.\n";
+                levels.clear();
+                return;
+            }
+        }
+
+        entries.reset(new tile_cache::tile_entry[tile_count]);
+        for (int i = 0; i < tile_count; i++)
+            entries[i].store(nullptr);
+    }
+
+    tiled_mipmap(const tiled_mipmap&) = delete;
+    tiled_mipmap& operator=(const tiled_mipmap&) = delete;
+
+    ~tiled_mipmap() {
+        if (entries) cache.release(entries.get(), tile_count);
+    }
+
+    int level_count() const { return int(levels.size()); }
+    int level_width(int level) const { return levels[level].width; }
+    int level_height(int level) const { return levels[level].height; }
+
+    size_t file_size() const { return file.size(); }
+
+    // Returns the texel at (x,y) of a level, clamping (x,y) to the level's edges.
+    color texel(int level, int x, int y) const {
+        const auto& l = levels[level];
+        x = clamp(x, l.width);
+        y = clamp(y, l.height);
+
+        int tile = l.first_tile + (y / tile_size) * l.tiles_wide + x / tile_size;
+        color result;
+        cache.access(entries[tile],
+            [&] { return texture_storage::from_bytes(tile_data(tile), tile_size, tile_size, format); },
+            [&](const texture_storage& t) { result = t.texel(x % tile_size, y % tile_size); });
+        return result;
+    }
+
+  private:
+    struct level_info {
+        int width, height;
+        int tiles_wide;
+        int first_tile;  // Index of the level's first tile in the file
+    };
+
+    // File layout: the magic number, then format, tile size and level count (int32), then
+    // the size and modification time of the source image (int64), then width and height of
+    // each level (int32), then every tile of every level, by rows.
+    static constexpr char magic[8] = {'R','T','W','T','I','L','E','2'};
+    static const size_t header_size = sizeof magic + 3 * sizeof(int32_t) + 2 * sizeof(int64_t);
+
+    texel_format format;
+    tile_cache& cache;
+    mapped_file file;
+    std::vector<level_info> levels;
+    int tile_count = 0;
+    size_t tiles_offset = 0;  // Where the tiles start in the file
+    std::unique_ptr<tile_cache::tile_entry[]> entries;
+
+    static size_t tile_bytes(texel_format format) {
+        return texture_storage::encoded_size(tile_size, tile_size, format);
+    }
+
+    const unsigned char* tile_data(int tile) const {
+        return file.data() + tiles_offset + size_t(tile) * tile_bytes(format);
+    }
+
+    // Names the tile file of the image at source after the image and a hash of its absolute
+    // path, so images of the same name in different directories get files of their own.
+    static std::string tile_path(const std::string& source, texel_format format) {
+        auto name = source;
+        auto slash = name.find_last_of("/\\");
+        if (slash != std::string::npos) name = name.substr(slash + 1);
+
+#ifdef _WIN32
+        char* absolute = _fullpath(nullptr, source.c_str(), 0);
+#else
+        char* absolute = realpath(source.c_str(), nullptr);
+#endif
+        std::string key = absolute ? absolute : source;
+        std::free(absolute);
+
+        uint64_t hash = 14695981039346656037ull;  // 64-bit FNV-1a
+        for (unsigned char c : key) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        char hex[17];
+        std::snprintf(hex, sizeof hex, "%016llx", (unsigned long long)hash);
+
+        auto dir = std::getenv("RTW_TILE_DIR");
+        return (dir ? std::string(dir) + "/" : std::string()) + name + "." + hex + "."
+               + texel_format_name(format) + ".tiles";
+    }
+
+    // The size and modification time of the image at source, which a tile file records to
+    // tell whether the image changed since it was converted; zeros if it can't be read.
+    static std::array<int64_t, 2> source_stamp(const std::string& source) {
+        struct stat info;
+        if (stat(source.c_str(), &info) != 0) return {0, 0};
+        return {int64_t(info.st_size), int64_t(info.st_mtime)};
+    }
+
+    bool read_header(const std::string& path, const std::array<int64_t, 2>& stamp) {
+        if (!file.open(path) || file.size() < header_size) return false;
+        if (std::memcmp(file.data(), magic, sizeof magic) != 0) return false;
+
+        int32_t fields[3];
+        std::memcpy(fields, file.data() + sizeof magic, sizeof fields);
+        if (fields[0] != int32_t(format) || fields[1] != tile_size) return false;
+
+        int64_t source[2];
+        std::memcpy(source, file.data() + sizeof magic + sizeof fields, sizeof source);
+        if (source[0] != stamp[0] || source[1] != stamp[1]) return false;
+
+        auto level_sizes = file.data() + header_size;
+        tiles_offset = header_size + 8 * size_t(fields[2]);
+        if (file.size() < tiles_offset) return false;
+
+        levels.clear();
+        tile_count = 0;
+        for (int i = 0; i < fields[2]; i++) {
+            int32_t size[2];
+            std::memcpy(size, level_sizes + 8*i, sizeof size);
+
+            int tiles_wide = (size[0] + tile_size - 1) / tile_size;
+            int tiles_high = (size[1] + tile_size - 1) / tile_size;
+            levels.push_back({size[0], size[1], tiles_wide, tile_count});
+            tile_count += tiles_wide * tiles_high;
+        }
+
+        return file.size() >= tiles_offset + size_t(tile_count) * tile_bytes(format);
+    }
+
+    void convert(const std::string& source, const std::string& path,
+                 const std::array<int64_t, 2>& stamp) const {
+        rtw_image image(source.c_str());
+        if (image.height() <= 0) return;
+
+        // Build every level's linear pixels, as mipmap does.
+        std::vector<std::vector<float>> pixels;
+        std::vector<int32_t> sizes;
+        int width = image.width(), height = image.height();
+        pixels.emplace_back(image.float_data(), image.float_data() + 3*width*height);
+        sizes.insert(sizes.end(), {width, height});
+        while (width > 1 || height > 1) {
+            pixels.push_back(half_level(pixels.back().data(), width, height));
+            sizes.insert(sizes.end(), {width, height});
+        }
+
+        auto out = std::fopen(path.c_str(), "wb");
+        if (!out) return;
+
+        int32_t fields[3] = {int32_t(format), tile_size, int32_t(pixels.size())};
+        std::fwrite(magic, 1, sizeof magic, out);
+        std::fwrite(fields, sizeof fields, 1, out);
+        std::fwrite(stamp.data(), sizeof(int64_t), stamp.size(), out);
+        std::fwrite(sizes.data(), sizeof(int32_t), sizes.size(), out);
+
+        // Cut each level into tiles, repeating edge texels to fill partial tiles.
+        std::vector<float> tile(3 * tile_size * tile_size);
+        for (size_t level = 0; level < pixels.size(); level++) {
+            int w = sizes[2*level], h = sizes[2*level + 1];
+            for (int ty = 0; ty < h; ty += tile_size) {
+                for (int tx = 0; tx < w; tx += tile_size) {
+                    for (int y = 0; y < tile_size; y++) {
+                        for (int x = 0; x < tile_size; x++) {
+                            int sx = std::min(tx + x, w - 1), sy = std::min(ty + y, h - 1);
+                            for (int c = 0; c < 3; c++)
+                                tile[3*(y*tile_size + x) + c] = pixels[level][3*(sy*w + sx) + c];
+                        }
+                    }
+
+                    texture_storage encoded(tile.data(), tile_size, tile_size, format);
+                    std::fwrite(encoded.bytes(), 1, encoded.size_in_bytes(), out);
+                }
+            }
+        }
+
+        std::fclose(out);
+    }
+};
+
+#endif
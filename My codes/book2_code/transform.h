@@ -0,0 +1,100 @@
+// This file defines rigid_transform, a rotation followed by a translation. It is used to
+// bake the translate and rotate_y instances into world space when a scene is flattened.
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+class rigid_transform {
+  public:
+    double m[3][3] = {{1,0,0}, {0,1,0}, {0,0,1}};  // Rotation
+    vec3 offset;                                   // Translation, applied after the rotation
+
+    static rigid_transform translation(const vec3& offset) {
+        rigid_transform t;
+        t.offset = offset;
+        return t;
+    }
+
+    static rigid_transform rotation_y(double sin_theta, double cos_theta) {
+        rigid_transform t;
+        t.m[0][0] =  cos_theta; t.m[0][2] = sin_theta;
+        t.m[2][0] = -sin_theta; t.m[2][2] = cos_theta;
+        return t;
+    }
+
+    bool is_identity() const {
+        return m[0][0] == 1 && m[1][1] == 1 && m[2][2] == 1
+            && m[0][1] == 0 && m[0][2] == 0 && m[1][0] == 0
+            && m[1][2] == 0 && m[2][0] == 0 && m[2][1] == 0
+            && offset.x() == 0 && offset.y() == 0 && offset.z() == 0;
+    }
+
+    bool has_rotation() const {
+        return m[0][0] != 1 || m[1][1] != 1 || m[2][2] != 1;
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                    m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                    m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+    }
+
+    point3 point(const point3& p) const {
+        return vector(p) + offset;
+    }
+
+    // The inverse mappings use the transpose, since the rotation is orthonormal.
+
+    vec3 inverse_vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+                    m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+                    m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+    }
+
+    point3 inverse_point(const point3& p) const {
+        return inverse_vector(p - offset);
+    }
+
+    ray inverse_ray(const ray& r) const {
+        return ray(inverse_point(r.origin()), inverse_vector(r.direction()), r.time());
+    }
+
+    aabb box(const aabb& bbox) const {
+        // Returns the box enclosing the transformed corners of bbox.
+        point3 min( infinity,  infinity,  infinity);
+        point3 max(-infinity, -infinity, -infinity);
+
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                for (int k = 0; k < 2; k++) {
+                    auto corner = point(point3(i ? bbox.x.max : bbox.x.min,
+                                               j ? bbox.y.max : bbox.y.min,
+                                               k ? bbox.z.max : bbox.z.min));
+                    for (int c = 0; c < 3; c++) {
+                        min[c] = std::fmin(min[c], corner[c]);
+                        max[c] = std::fmax(max[c], corner[c]);
+                    }
+                }
+            }
+        }
+
+        return aabb(min, max);
+    }
+};
+
+// Composes two transforms: (a * b) applies b first, then a.
+inline rigid_transform operator*(const rigid_transform& a, const rigid_transform& b) {
+    rigid_transform t;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            t.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+        }
+    }
+    t.offset = a.point(b.offset);
+    return t;
+}
+
+#endif
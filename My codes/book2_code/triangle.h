@@ -10,6 +10,8 @@ class triangle : public hittable {
     triangle(const point3& _Q, const vec3& _u, const vec3& _v, shared_ptr<material> m)
       : Q(_Q), u(_u), v(_v), mat(m)
     {
+        normal = unit_vector(cross(u, v));
+        uv_scale = 1 / std::sqrt(u.length() * v.length());
         set_bounding_box();
     }
 
@@ -32,33 +34,30 @@ class triangle : public hittable {
         vec3 edge1 = u;
         vec3 edge2 = v;
         vec3 h = cross(r.direction(), edge2);
-        double a = dot(edge1, h);
+        auto a = dot(edge1, h);
 
         if (a > -EPSILON && a < EPSILON)
             return false;    // This ray is parallel to this triangle.
 
-        double f = 1.0 / a;
+        auto f = 1 / a;
         vec3 s = r.origin() - Q;
-        double u_bary = f * dot(s, h);
+        auto u_bary = f * dot(s, h);
 
         if (u_bary < 0.0 || u_bary > 1.0)
             return false;
 
         vec3 q = cross(s, edge1);
-        double v_bary = f * dot(r.direction(), q);
+        auto v_bary = f * dot(r.direction(), q);
 
         if (v_bary < 0.0 || u_bary + v_bary > 1.0)
             return false;
 
         // At this stage we can compute t to find out where the intersection point is on the ray.
-        double t = f * dot(edge2, q);
+        auto t = f * dot(edge2, q);
 
         if (ray_t.contains(t)) {
             rec.t = t;
-            rec.p = r.at(t);
-            vec3 outward_normal = unit_vector(cross(edge1, edge2));
-            rec.set_face_normal(r, outward_normal);
-            rec.mat = mat;
+            rec.object = this;
             rec.u = u_bary;
             rec.v = v_bary;
             return true;
@@ -67,9 +66,22 @@ class triangle : public hittable {
             return false;
     }
 
+    void compute_surface(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(r, normal);
+        rec.uv_scale = uv_scale;
+        rec.mat = mat;
+    }
+
+    bool flatten(scene_compiler& compiler, const rigid_transform& to_world) const override {
+        return compiler.add_triangle(to_world.point(Q), to_world.vector(u), to_world.vector(v), mat);
+    }
+
   private:
     point3 Q;
     vec3 u, v;
+    vec3 normal;
+    real uv_scale;  // See hit_record::uv_scale
     shared_ptr<material> mat;
     aabb bbox;
 };
@@ -0,0 +1,153 @@
+// This file specializes vec3 for single precision on x86, storing each vector (and color)
+// in one 4-lane SSE register with the last lane kept at zero. It is used when building
+// with -DRTW_USE_SIMD, and is included from vec3.h.
+//
+// The operations are inlined into their callers, so they are compiled for the build's
+// instruction set: SSE2, which every x86-64 CPU has, or e.g. AVX2/FMA with -mavx2 -mfma.
+// Wider kernels that can be picked at runtime use simd.h.
+
+#ifndef VEC3_SIMD_H
+#define VEC3_SIMD_H
+
+#include "simd.h"
+
+#ifdef RTW_X86
+
+template <>
+class alignas(16) basic_vec3<float> {
+  public:
+    using scalar = float;
+
+    union {
+        __m128 v;
+        float e[4];
+    };
+
+    basic_vec3() : v(_mm_setzero_ps()) {}
+    basic_vec3(float e0, float e1, float e2) : v(_mm_set_ps(0, e2, e1, e0)) {}
+    explicit basic_vec3(__m128 v) : v(v) {}
+
+    template <typename U>
+    explicit basic_vec3(const basic_vec3<U>& u)
+      : v(_mm_set_ps(0, float(u.e[2]), float(u.e[1]), float(u.e[0]))) {}
+
+    float x() const { return e[0]; }
+    float y() const { return e[1]; }
+    float z() const { return e[2]; }
+
+    basic_vec3 operator-() const { return basic_vec3(_mm_sub_ps(_mm_setzero_ps(), v)); }
+    float operator[](int i) const { return e[i]; }
+    float& operator[](int i) { return e[i]; }
+
+    basic_vec3& operator+=(const basic_vec3& u) {
+        v = _mm_add_ps(v, u.v);
+        return *this;
+    }
+
+    basic_vec3& operator*=(float t) {
+        v = _mm_mul_ps(v, _mm_set1_ps(t));
+        return *this;
+    }
+
+    basic_vec3& operator/=(float t) {
+        return *this *= 1/t;
+    }
+
+    float length() const {
+        return std::sqrt(length_squared());
+    }
+
+    float length_squared() const {
+        return _mm_cvtss_f32(dot_splat(v, v));
+    }
+
+    bool near_zero() const {
+        // Return true if the vector is close to zero in all dimensions.
+        auto abs = _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+        return (_mm_movemask_ps(_mm_cmplt_ps(abs, _mm_set1_ps(1e-8f))) & 7) == 7;
+    }
+
+    static basic_vec3 random() {
+        return basic_vec3(random_double(), random_double(), random_double());
+    }
+
+    static basic_vec3 random(double min, double max) {
+        return basic_vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+    }
+
+    // Returns the dot product of a and b in every lane.
+    static __m128 dot_splat(__m128 a, __m128 b) {
+#ifdef __SSE4_1__
+        return _mm_dp_ps(a, b, 0x7f);
+#else
+        auto m = _mm_mul_ps(a, b);
+        auto s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2,3,0,1)));
+        return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1,0,3,2)));
+#endif
+    }
+};
+
+using vec3f_simd = basic_vec3<float>;
+
+// Vector utility functions for the SSE vec3. These plain overloads take precedence over
+// the generic templates in vec3.h.
+
+inline vec3f_simd operator+(const vec3f_simd& u, const vec3f_simd& v) {
+    return vec3f_simd(_mm_add_ps(u.v, v.v));
+}
+
+inline vec3f_simd operator-(const vec3f_simd& u, const vec3f_simd& v) {
+    return vec3f_simd(_mm_sub_ps(u.v, v.v));
+}
+
+inline vec3f_simd operator*(const vec3f_simd& u, const vec3f_simd& v) {
+    return vec3f_simd(_mm_mul_ps(u.v, v.v));
+}
+
+inline vec3f_simd operator*(float t, const vec3f_simd& v) {
+    return vec3f_simd(_mm_mul_ps(_mm_set1_ps(t), v.v));
+}
+
+inline vec3f_simd operator*(const vec3f_simd& v, float t) {
+    return t * v;
+}
+
+inline vec3f_simd operator/(const vec3f_simd& v, float t) {
+    return (1/t) * v;
+}
+
+inline float dot(const vec3f_simd& u, const vec3f_simd& v) {
+    return _mm_cvtss_f32(vec3f_simd::dot_splat(u.v, v.v));
+}
+
+inline vec3f_simd cross(const vec3f_simd& u, const vec3f_simd& v) {
+    // u.yzx * v.zxy - u.zxy * v.yzx, computed with one shuffle of each input.
+    auto u_yzx = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(3,0,2,1));
+    auto v_yzx = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(3,0,2,1));
+    auto c = _mm_sub_ps(_mm_mul_ps(u.v, v_yzx), _mm_mul_ps(u_yzx, v.v));
+    return vec3f_simd(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1)));
+}
+
+inline vec3f_simd unit_vector(const vec3f_simd& v) {
+    return vec3f_simd(_mm_div_ps(v.v, _mm_sqrt_ps(vec3f_simd::dot_splat(v.v, v.v))));
+}
+
+inline vec3f_simd reflect(const vec3f_simd& v, const vec3f_simd& n) {
+    auto d = vec3f_simd::dot_splat(v.v, n.v);
+    return vec3f_simd(_mm_sub_ps(v.v, _mm_mul_ps(_mm_add_ps(d, d), n.v)));
+}
+
+inline vec3f_simd refract(const vec3f_simd& uv, const vec3f_simd& n, double etai_over_etat) {
+    auto cos_theta = _mm_min_ps(vec3f_simd::dot_splat(_mm_sub_ps(_mm_setzero_ps(), uv.v), n.v),
+                                _mm_set1_ps(1));
+    auto r_out_perp = _mm_mul_ps(_mm_set1_ps(float(etai_over_etat)),
+                                 _mm_add_ps(uv.v, _mm_mul_ps(cos_theta, n.v)));
+    auto perp_len2 = vec3f_simd::dot_splat(r_out_perp, r_out_perp);
+    auto abs_diff = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(_mm_set1_ps(1), perp_len2));
+    auto r_out_parallel = _mm_mul_ps(_mm_sqrt_ps(abs_diff), n.v);
+    return vec3f_simd(_mm_sub_ps(r_out_perp, r_out_parallel));
+}
+
+#endif // RTW_X86
+
+#endif
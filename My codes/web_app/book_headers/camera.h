@@ -123,11 +123,12 @@ class camera {
             return color(0,0,0);
 
         if (world.hit(r, interval(0.001, infinity), rec)) {
+            color emitted = rec.mat->emitted(rec.p);
             ray scattered;
             color attenuation;
             if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, world, depth-1);
-            return color(0,0,0);
+                return emitted + attenuation * ray_color(scattered, world, depth-1);
+            return emitted;
         }
 
         // If the ray hits nothing, return the background color.
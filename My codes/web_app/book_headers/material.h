@@ -1,6 +1,9 @@
 // This file defines the abstract material base class, which provides the interface
 // for how rays interact with surfaces. It includes concrete implementations for
-// lambertian (diffuse), metal (reflective), and dielectric (refractive) materials.
+// lambertian (diffuse), metal (reflective), and dielectric (refractive) materials, and
+// diffuse_light, which emits. Diffuse materials also report the density of the directions
+// they scatter into and evaluate their scattering toward a given direction, so the
+// renderer can light them by sampling points on lights.
 
 #ifndef MATERIAL_H
 #define MATERIAL_H
@@ -15,6 +18,11 @@ class material {
   public:
     virtual ~material() = default;
 
+    // Light emitted from point p of the surface.
+    virtual color emitted(const point3& p) const {
+        return color(0,0,0);
+    }
+
     // Computes a scattered ray based on the hit record and material properties.
     // r_in: The incoming ray.
     // rec: The hit_record of the intersection.
@@ -23,6 +31,20 @@ class material {
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const = 0;
+
+    // The density, over solid angle, with which scatter() picks direction. Zero for
+    // materials that scatter into single directions (mirrors, glass) or can't tell.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction)
+    const {
+        return 0;
+    }
+
+    // The light scattered back along r_in per unit of light arriving from direction: the
+    // BSDF times the cosine. For directions scatter() picks, attenuation is eval() /
+    // scattering_pdf().
+    virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        return color(0,0,0);
+    }
 };
 
 // A diffuse (matte) material.
@@ -43,6 +65,17 @@ class lambertian : public material {
         return true;
     }
 
+    // Directions are cosine weighted about the normal: the density is cos(theta) / pi.
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction)
+    const override {
+        auto cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0 ? cosine / pi : 0;
+    }
+
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return scattering_pdf(r_in, rec, direction) * albedo;
+    }
+
   private:
     color albedo;
 };
@@ -101,4 +134,22 @@ class dielectric : public material {
     }
 };
 
+// A material that emits light from both sides and scatters none.
+class diffuse_light : public material {
+  public:
+    diffuse_light(const color& emit) : emit(emit) {}
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+    const override {
+        return false;
+    }
+
+    color emitted(const point3& p) const override {
+        return emit;
+    }
+
+  private:
+    color emit;
+};
+
 #endif
\ No newline at end of file
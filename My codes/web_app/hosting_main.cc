@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -36,22 +37,33 @@ vec3   u, v, w;
 vec3   defocus_disk_u;
 vec3   defocus_disk_v;
 
+double sky_brightness;  // Scale of the sky gradient; 0 for a night scene lit by the lights
+int    light_count;     // Emissive spheres added to the scene
+bool   use_restir;      // Light diffuse surfaces seen by the camera with reservoir resampling
 
-color ray_color(const ray& r, const hittable& world, int depth) {
+
+color sky_color(const ray& r) {
+    vec3 unit_direction = unit_vector(r.direction());
+    auto a = 0.5 * (unit_direction.y() + 1.0);
+    return sky_brightness * ((1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0));
+}
+
+// count_lights is false for rays scattered from surfaces whose direct light was already
+// gathered from the lights, so the emission of a light they hit isn't counted twice.
+color ray_color(const ray& r, const hittable& world, int depth, bool count_lights = true) {
     hit_record rec;
     if (depth <= 0) return color(0,0,0);
 
     if (world.hit(r, interval(0.001, infinity), rec)) {
+        color emitted = count_lights ? rec.mat->emitted(rec.p) : color(0,0,0);
         ray scattered;
         color attenuation;
         if (rec.mat->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth-1);
-        return color(0,0,0);
+            return emitted + attenuation * ray_color(scattered, world, depth-1);
+        return emitted;
     }
 
-    vec3 unit_direction = unit_vector(r.direction());
-    auto a = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
+    return sky_color(r);
 }
 
 vec3 pixel_sample_square() {
@@ -102,6 +114,234 @@ void initialize_camera() {
     defocus_disk_v = v * defocus_radius;
 }
 
+// =========================================================================================
+// ReSTIR Direct Lighting
+// =========================================================================================
+//
+// Direct light on the diffuse surfaces the camera sees is estimated by resampling points on
+// the lights (Bitterli et al., "Spatiotemporal Reservoir Resampling for Real-Time Ray
+// Tracing with Dynamic Direct Lighting"). Each pixel streams a few dozen cheap candidate
+// points through a reservoir that keeps one of them with probability proportional to the
+// unshadowed light it would deliver. The reservoir is then merged with the pixel's reservoir
+// from the previous pass (temporal reuse; the camera doesn't move during a render) and with
+// those of nearby pixels on similar surfaces (spatial reuse), so each pixel effectively
+// picks from thousands of candidates, and only the winner is traced for shadowing.
+
+struct sphere_light {
+    point3 center;
+    double radius;
+    color emit;
+};
+
+std::vector<sphere_light> scene_lights;
+
+const int    restir_candidates = 32;      // Light points tried per pixel and pass
+const int    restir_neighbors = 5;        // Nearby pixels merged per pass
+const double restir_history = 20;         // Candidates a reservoir may carry, per pass's worth
+
+// A point on one of the scene's lights.
+struct light_point {
+    int light = -1;  // Index into scene_lights, or -1 for none
+    point3 p;
+    vec3 normal;
+};
+
+// The first surface seen through a pixel in the current pass, and the ray scattered from it.
+struct pixel_surface {
+    bool hit = false;
+    ray r;               // Camera ray
+    hit_record rec;
+    bool scatters = false;
+    ray scattered;
+    color attenuation;
+    bool lit = false;    // Whether the surface's direct light comes from its reservoir
+};
+
+struct reservoir {
+    light_point y;     // The kept candidate
+    double w_sum = 0;  // Sum of the weights of all candidates seen
+    double M = 0;      // Number of candidates seen
+    double W = 0;      // Weight that makes the kept candidate's light an unbiased estimate
+
+    // Streams in a candidate of weight w standing for count candidates, keeping it with
+    // probability w over the weights seen so far.
+    void update(const light_point& x, double w, double count) {
+        w_sum += w;
+        M += count;
+        if (w > 0 && random_double() * w_sum < w)
+            y = x;
+    }
+};
+
+light_point sample_light_point(double& pdf) {
+    // A light picked uniformly, and a point uniform over its area.
+    light_point x;
+    x.light = std::min(int(random_double() * scene_lights.size()), int(scene_lights.size()) - 1);
+    const auto& l = scene_lights[x.light];
+    x.normal = random_unit_vector();
+    x.p = l.center + l.radius * x.normal;
+    pdf = 1 / (scene_lights.size() * 4*pi * l.radius*l.radius);
+    return x;
+}
+
+// The light the point y sends to the surface s and scatters toward the camera, ignoring
+// whatever may block it.
+color unshadowed_light(const pixel_surface& s, const light_point& y) {
+    vec3 to_light = y.p - s.rec.p;
+    auto distance_squared = to_light.length_squared();
+    auto direction = to_light / std::sqrt(distance_squared);
+    auto cos_light = dot(y.normal, -direction);
+    if (cos_light <= 0) return color(0,0,0);  // The far side of the sphere
+
+    auto f = s.rec.mat->eval(s.r, s.rec, direction);
+    return f * scene_lights[y.light].emit * (cos_light / distance_squared);
+}
+
+// The target density the reservoirs resample toward: the brightness of unshadowed_light().
+double target(const pixel_surface& s, const light_point& y) {
+    if (!s.lit || y.light < 0) return 0;
+    auto c = unshadowed_light(s, y);
+    return (c.x() + c.y() + c.z()) / 3;
+}
+
+bool visible(const hittable& world, const pixel_surface& s, const light_point& y) {
+    hit_record rec;
+    return !world.hit(ray(s.rec.p, y.p - s.rec.p), interval(0.001, 0.999), rec);
+}
+
+// Merges reservoirs into one for the surface s. Each input offers its kept candidate with
+// weight target * W * M. The result's W divides by the candidates of the inputs whose
+// surfaces could have produced the winner, which keeps reuse across surfaces that don't
+// see the same lights from biasing the estimate. If other_pixels, the inputs after the
+// first come from other pixels, whose reservoirs dropped the candidates they couldn't see,
+// so that check takes a shadow ray.
+reservoir combine(const hittable& world, const pixel_surface& s,
+                  const std::vector<const reservoir*>& inputs,
+                  const std::vector<const pixel_surface*>& surfaces, bool other_pixels) {
+    reservoir out;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const auto& r = *inputs[i];
+        out.update(r.y, target(s, r.y) * r.W * r.M, r.M);
+    }
+
+    double Z = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const auto& source = *surfaces[i];
+        if (target(source, out.y) > 0 && (i == 0 || !other_pixels || visible(world, source, out.y)))
+            Z += inputs[i]->M;
+    }
+
+    auto p = target(s, out.y);
+    out.W = (Z > 0 && p > 0) ? out.w_sum / (Z * p) : 0;
+    return out;
+}
+
+// Traces the camera ray of each pixel to its first surface and scatters from it.
+void find_surfaces(const hittable& world, std::vector<pixel_surface>& surfaces) {
+    for (int j = 0; j < image_height; ++j) {
+        for (int i = 0; i < image_width; ++i) {
+            auto& s = surfaces[j*image_width + i];
+            s = pixel_surface();
+            s.r = get_ray(i, j);
+            s.hit = world.hit(s.r, interval(0.001, infinity), s.rec);
+            if (!s.hit) continue;
+
+            s.scatters = s.rec.mat->scatter(s.r, s.rec, s.attenuation, s.scattered);
+            s.lit = s.scatters && s.rec.mat->scattering_pdf(s.r, s.rec, s.scattered.direction()) > 0;
+        }
+    }
+}
+
+// One pass of reservoir resampling: fresh candidates, then temporal and spatial reuse.
+// history holds each pixel's reservoir of the last pass, found for previous_surfaces, and
+// is replaced by this pass's. Merging in the neighbors gives the reservoirs to shade with;
+// they aren't carried into the history, where the spatial normalization's rare large
+// weights would compound from pass to pass.
+void resample_lights(const hittable& world, const std::vector<pixel_surface>& surfaces,
+                     const std::vector<pixel_surface>& previous_surfaces,
+                     std::vector<reservoir>& history, std::vector<reservoir>& shading,
+                     bool first_pass) {
+    std::vector<reservoir> temporal(surfaces.size());
+    auto max_count = restir_history * restir_candidates;
+
+    for (size_t n = 0; n < surfaces.size(); n++) {
+        const auto& s = surfaces[n];
+        if (!s.lit) continue;
+
+        reservoir fresh;
+        for (int k = 0; k < restir_candidates; k++) {
+            double pdf;
+            auto x = sample_light_point(pdf);
+            fresh.update(x, target(s, x) / pdf, 1);
+        }
+        auto p = target(s, fresh.y);
+        fresh.W = p > 0 ? fresh.w_sum / (fresh.M * p) : 0;
+
+        // A candidate that is shadowed here is no use to reuse either.
+        if (fresh.W > 0 && !visible(world, s, fresh.y))
+            fresh.W = 0;
+
+        if (first_pass || history[n].M <= 0) {
+            temporal[n] = fresh;
+            continue;
+        }
+
+        auto past = history[n];
+        past.M = std::min(past.M, max_count);
+        temporal[n] = combine(world, s, {&fresh, &past}, {&s, &previous_surfaces[n]}, false);
+    }
+
+    // Neighbors are picked in a disk about 30 pixels wide at 1200 pixels across, and
+    // skipped if their surface faces another way or lies at another depth.
+    auto radius = std::max(3.0, image_width / 40.0);
+    for (size_t n = 0; n < surfaces.size(); n++) {
+        const auto& s = surfaces[n];
+        if (!s.lit) {
+            shading[n] = reservoir();
+            continue;
+        }
+
+        std::vector<const reservoir*> inputs{&temporal[n]};
+        std::vector<const pixel_surface*> sources{&s};
+        int i = int(n) % image_width, j = int(n) / image_width;
+        auto depth = (s.rec.p - s.r.origin()).length();
+
+        for (int k = 0; k < restir_neighbors; k++) {
+            auto offset = radius * random_in_unit_disk();
+            int ni = i + int(std::lround(offset.x())), nj = j + int(std::lround(offset.y()));
+            if (ni < 0 || nj < 0 || ni >= image_width || nj >= image_height) continue;
+
+            size_t m = size_t(nj) * image_width + ni;
+            const auto& q = surfaces[m];
+            if (m == n || !q.lit) continue;
+            if (dot(q.rec.normal, s.rec.normal) < 0.906) continue;  // More than 25 degrees apart
+            if (std::fabs((q.rec.p - q.r.origin()).length() - depth) > 0.1 * depth) continue;
+
+            inputs.push_back(&temporal[m]);
+            sources.push_back(&q);
+        }
+
+        shading[n] = combine(world, s, inputs, sources, true);
+    }
+    history = std::move(temporal);
+}
+
+// The color of a pixel's camera ray, taking the direct light of a lit surface from its
+// reservoir and the rest by scattering.
+color restir_color(const hittable& world, const pixel_surface& s, const reservoir& r) {
+    if (!s.hit) return sky_color(s.r);
+
+    color emitted = s.rec.mat->emitted(s.rec.p);
+    if (!s.scatters) return emitted;
+
+    color direct(0,0,0);
+    if (s.lit && r.W > 0 && visible(world, s, r.y))
+        direct = r.W * unshadowed_light(s, r.y);
+
+    color indirect = s.attenuation * ray_color(s.scattered, world, max_depth-1, !s.lit);
+    return emitted + direct + indirect;
+}
+
 // =========================================================================================
 
 double string_to_double(const char* s) { return std::stod(s); }
@@ -129,6 +369,9 @@ int main(int argc, char* argv[]) {
     vup               = vec3(0,1,0);
     defocus_angle     = 0.2;
     focus_dist        = 15.0;
+    sky_brightness    = 1.0;
+    light_count       = 0;
+    use_restir        = false;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -140,6 +383,9 @@ int main(int argc, char* argv[]) {
         else if (arg == "--depth" && i + 1 < argc) max_depth = string_to_int(argv[++i]);
         else if (arg == "--width" && i + 1 < argc) image_width = string_to_int(argv[++i]);
         else if (arg == "--aspect" && i + 1 < argc) aspect_ratio = string_to_double(argv[++i]);
+        else if (arg == "--sky" && i + 1 < argc) sky_brightness = string_to_double(argv[++i]);
+        else if (arg == "--lights" && i + 1 < argc) light_count = string_to_int(argv[++i]);
+        else if (arg == "--restir" && i + 1 < argc) use_restir = string_to_int(argv[++i]) != 0;
     }
 
     hittable_list world;
@@ -174,17 +420,38 @@ int main(int argc, char* argv[]) {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
+    // Small glowing spheres floating among the others, in a few colors.
+    for (int n = 0; n < light_count; n++) {
+        auto tint = color(0.5, 0.5, 0.5) + 0.5 * color::random();
+        sphere_light l{point3(random_double(-11, 11), random_double(0.4, 2.5), random_double(-11, 11)),
+                       random_double(0.05, 0.15), random_double(10, 40) * tint};
+        scene_lights.push_back(l);
+        world.add(make_shared<sphere>(l.center, l.radius, make_shared<diffuse_light>(l.emit)));
+    }
+    use_restir = use_restir && !scene_lights.empty();
+
     initialize_camera();
 
     std::vector<color> pixel_colors(image_width * image_height);
     std::vector<unsigned char> image_data(image_width * image_height * 3);
+    std::vector<pixel_surface> surfaces(use_restir ? image_width * image_height : 0);
+    std::vector<pixel_surface> previous_surfaces(surfaces.size());
+    std::vector<reservoir> history(surfaces.size()), reservoirs(surfaces.size());
 
     for (int s = 1; s <= samples_per_pixel; ++s) {
         write_status_file(s, samples_per_pixel);
-        for (int j = 0; j < image_height; ++j) {
-            for (int i = 0; i < image_width; ++i) {
-                ray r = get_ray(i, j);
-                pixel_colors[j*image_width + i] += ray_color(r, world, max_depth);
+        if (use_restir) {
+            std::swap(surfaces, previous_surfaces);
+            find_surfaces(world, surfaces);
+            resample_lights(world, surfaces, previous_surfaces, history, reservoirs, s == 1);
+            for (size_t n = 0; n < surfaces.size(); n++)
+                pixel_colors[n] += restir_color(world, surfaces[n], reservoirs[n]);
+        } else {
+            for (int j = 0; j < image_height; ++j) {
+                for (int i = 0; i < image_width; ++i) {
+                    ray r = get_ray(i, j);
+                    pixel_colors[j*image_width + i] += ray_color(r, world, max_depth);
+                }
             }
         }
         for (int j = 0; j < image_height; ++j) {
@@ -48,7 +48,10 @@ def start_render():
             "--samples", request.args.get('samples', '10'),
             "--depth", request.args.get('depth', '10'),
             "--width", request.args.get('width', '400'),
-            "--aspect", request.args.get('aspect', '1.777')
+            "--aspect", request.args.get('aspect', '1.777'),
+            "--sky", request.args.get('sky', '1'),
+            "--lights", request.args.get('lights', '0'),
+            "--restir", request.args.get('restir', '0')
         ]
         
         print(f"Starting new render with command: {' '.join(args)}")